@@ -0,0 +1,567 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_ext.h"
+#include "bench_util.h"
+
+/*******
+ * FS benchmark: formats and mounts a scratch disk image and runs synthetic
+ * workloads on it, reporting for each one ops/sec, bytes/sec, latency
+ * percentiles and physical disk reads/writes per operation.
+ *
+ * usage: bench [-d image] [-n blocks] [-o ops] [-s seed] [-c cacheblocks]
+ *              [-W] [-z] [-b blocksize] [-t threads] [-f text|csv|json]
+ *              [workload ...]
+ * workloads: seqwrite seqread randrw churn mount mtread stress snapshot
+ *            (default: all)
+ * mtread runs concurrent readers with 1, 2, 4... up to -t threads, one
+ * result each, to show how reads scale across cores. stress runs -t
+ * threads writing, reading and deleting private and shared files at once
+ * and checks all they read (exit status 1 if wrong, or if a write churn
+ * makes to its full directory leaks blocks). snapshot clones a
+ * file before each small write to it. -z stores the data (a repeating
+ * pattern) in compressed extents. -b formats the large format with
+ * blocksize byte blocks (see fs_format_config).
+ */
+
+#define MAXIO 8192 // largest read/write (fs_write max length)
+#define MAXRESULTS 8 // results of one workload
+#define MTFILES 8    // files read by mtread
+
+char *image = "bench.img";
+int nblocks = 16384;
+int nops = 2000;
+int cacheBlocks = 64;
+int writeThrough = 0;
+int compress = 0;
+int blockSize = 0;
+int nthreads = 4;
+const char *format = "text";
+char buf[MAXIO];
+
+void freshDisk() {
+    quiet(1);
+    fs_unmount();
+    fs_cache_config(cacheBlocks, writeThrough);
+    fs_compress_config(compress);
+    fs_format("bench");
+    fs_mount();
+    quiet(0);
+}
+
+void remount() {
+    quiet(1);
+    fs_unmount();
+    fs_mount();
+    quiet(0);
+}
+
+void fileName(char *name, int i) {
+    sprintf(name, "F%06d", i);
+}
+
+/**
+ * start/end measuring a workload: r->reads/writes get the disk I/O in between
+ */
+void begin(struct result *r, const char *name, long maxOps) {
+    struct fs_cache_stats io;
+
+    memset(r, 0, sizeof(*r));
+    r->name = name;
+    r->lat = malloc(maxOps * sizeof(long));
+    fs_sync();
+    fs_cache_stats(&io);
+    r->reads = io.reads;
+    r->writes = io.writes;
+    r->secs = clockNs();
+}
+
+void end(struct result *r) {
+    struct fs_cache_stats io;
+
+    fs_sync(); // count the deferred writes too
+    r->secs = (clockNs() - r->secs) / 1e9;
+    fs_cache_stats(&io);
+    r->reads = io.reads - r->reads;
+    r->writes = io.writes - r->writes;
+}
+
+void op(struct result *r, long long t0, int bytes) {
+    r->lat[r->ops++] = clockNs() - t0;
+    if (bytes > 0)
+        r->bytes += bytes;
+}
+
+/*****************************************************/
+
+int seqWrite(struct result *r) {
+    int size = (nblocks / 2) * (DISK_BLOCK_SIZE / 2); // a quarter of the disk
+
+    freshDisk();
+    begin(r, "seqwrite", size / MAXIO + 1);
+    for (int off = 0; off < size; off += MAXIO) {
+        long long t0 = clockNs();
+        op(r, t0, fs_write("SEQ", buf, MAXIO, off));
+    }
+    end(r);
+    return 1;
+}
+
+int seqRead(struct result *r) {
+    int size = (nblocks / 2) * (DISK_BLOCK_SIZE / 2);
+
+    freshDisk();
+    for (int off = 0; off < size; off += MAXIO)
+        fs_write("SEQ", buf, MAXIO, off);
+    remount(); // cold cache
+    begin(r, "seqread", size / MAXIO + 1);
+    for (int off = 0; off < size; off += MAXIO) {
+        long long t0 = clockNs();
+        op(r, t0, fs_read("SEQ", buf, MAXIO, off));
+    }
+    end(r);
+    return 1;
+}
+
+/**
+ * random offset reads and writes (1 byte to MAXIO) on a file
+ */
+int randRW(struct result *r) {
+    int size = (nblocks / 4) * (DISK_BLOCK_SIZE / 2);
+
+    freshDisk();
+    for (int off = 0; off < size; off += MAXIO)
+        fs_write("RND", buf, MAXIO, off);
+    begin(r, "randrw", nops);
+    for (int i = 0; i < nops; i++) {
+        int len = 1 + rand() % MAXIO;
+        int off = rand() % (size - len);
+        long long t0 = clockNs();
+        if (rand() % 2)
+            op(r, t0, fs_read("RND", buf, len, off));
+        else
+            op(r, t0, fs_write("RND", buf, len, off));
+    }
+    end(r);
+    return 1;
+}
+
+/**
+ * small files create/delete with a nearly full directory: it is filled
+ * until a create fails (the directory, or on small disks the disk, is
+ * full), then the last CHURNSLACK files are deleted again. While full, it
+ * checks that a write needing new extents fails with no blocks leaked or
+ * freed twice: one crossing the CHURNFAR extent boundary (a multiple of
+ * every extent size) of a file with a data block.
+ */
+#define CHURNSLACK 32
+#define CHURNFAR (1 << 20)
+
+long churnErrors;
+
+int churn(struct result *r) {
+    int nfiles = 0;
+    char name[16];
+    struct fs_stats before, after;
+
+    freshDisk();
+    quiet(1);
+    for (;; nfiles++) {
+        fileName(name, nfiles);
+        int len = 1 + rand() % 512;
+        if (fs_write(name, buf, len, 0) != len)
+            break;
+    }
+    for (int i = 0; i < nfiles; i++) {
+        char file[16];
+        fileName(file, i);
+        if (fs_read(file, buf, 17, 0) != 17)                // (no tiny file: it would get a block)
+            continue;
+        fs_stats(&before);
+        int res = fs_write(file, buf, MAXIO, CHURNFAR - MAXIO / 2);
+        fs_stats(&after);
+        if (res != 0 || after.freeBlocks != before.freeBlocks) {
+            fprintf(stderr, "churn: write past the full directory -> %d, free blocks %d -> %d\n",
+                    res, before.freeBlocks, after.freeBlocks);
+            churnErrors++;
+        }
+        break;
+    }
+    fs_delete(name);
+    for (int i = 0; i < CHURNSLACK && nfiles > 1; i++) {
+        fileName(name, --nfiles);
+        fs_delete(name);
+    }
+    quiet(0);
+    begin(r, "churn", 2 * nops);
+    for (int i = 0; i < nops; i++) {
+        fileName(name, rand() % nfiles);
+        long long t0 = clockNs();
+        fs_delete(name);
+        op(r, t0, 0);
+        int len = 1 + rand() % 512;
+        t0 = clockNs();
+        op(r, t0, fs_write(name, buf, len, 0));
+    }
+    end(r);
+    return 1;
+}
+
+/**
+ * mount time of a disk with many files
+ */
+int mountTime(struct result *r) {
+    int nfiles = nblocks / 4;
+    int rounds = 20;
+    char name[16];
+
+    freshDisk();
+    for (int i = 0; i < nfiles; i++) {
+        fileName(name, i);
+        fs_write(name, buf, 100, 0);
+    }
+    begin(r, "mount", rounds);
+    for (int i = 0; i < rounds; i++) {
+        quiet(1);
+        fs_unmount();
+        long long t0 = clockNs();
+        fs_mount();
+        op(r, t0, 0);
+        quiet(0);
+    }
+    end(r);
+    return 1;
+}
+
+/**
+ * snapshot-before-update: clone a file, write a few bytes of it (copying
+ * the shared blocks written) and delete the clone, each call an op
+ */
+int snapshot(struct result *r) {
+    int size = (nblocks / 8) * (DISK_BLOCK_SIZE / 2);
+
+    freshDisk();
+    for (int off = 0; off < size; off += MAXIO)
+        fs_write("ORIG", buf, MAXIO, off);
+    begin(r, "snapshot", 3 * nops);
+    for (int i = 0; i < nops; i++) {
+        long long t0 = clockNs();
+        fs_clone("ORIG", "SNAP");
+        op(r, t0, 0);
+        int len = 1 + rand() % 512;
+        int off = rand() % (size - len);
+        t0 = clockNs();
+        op(r, t0, fs_write("ORIG", buf, len, off));
+        t0 = clockNs();
+        fs_delete("SNAP");
+        op(r, t0, 0);
+    }
+    end(r);
+    return 1;
+}
+
+/**
+ * concurrent random reads (up to MAXIO bytes) of MTFILES files, with
+ * 1, 2, 4... nthreads threads, each doing nops reads
+ */
+struct reader {
+    struct result *r;
+    int first;  // first latency slot of this thread
+    unsigned int seed;
+    int size;   // size of each file
+};
+
+void *readerThread(void *arg) {
+    struct reader *rd = arg;
+    char name[16], data[MAXIO];
+
+    for (int i = 0; i < nops; i++) {
+        int len = 1 + rand_r(&rd->seed) % MAXIO;
+        int off = rand_r(&rd->seed) % (rd->size - len);
+        fileName(name, rand_r(&rd->seed) % MTFILES);
+        long long t0 = clockNs();
+        fs_read(name, data, len, off);
+        rd->r->lat[rd->first + i] = clockNs() - t0;
+        __atomic_fetch_add(&rd->r->bytes, len, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+int mtRead(struct result *r) {
+    static char names[MAXRESULTS][16];
+    int size = (nblocks / 2 / MTFILES) * DISK_BLOCK_SIZE;
+    char name[16];
+    int n = 0;
+
+    freshDisk();
+    for (int i = 0; i < MTFILES; i++) {
+        fileName(name, i);
+        fs_fallocate(name, size);
+    }
+    for (int t = 1;; t = 2 * t < nthreads ? 2 * t : nthreads) {
+        pthread_t tids[t];
+        struct reader rd[t];
+
+        sprintf(names[n], "mtread-%d", t);
+        begin(&r[n], names[n], (long) t * nops);
+        for (int i = 0; i < t; i++) {
+            rd[i] = (struct reader){&r[n], i * nops, (unsigned int) rand(), size};
+            pthread_create(&tids[i], NULL, readerThread, &rd[i]);
+        }
+        for (int i = 0; i < t; i++)
+            pthread_join(tids[i], NULL);
+        r[n].ops = (long) t * nops;
+        end(&r[n++]);
+        if (t == nthreads || n == MAXRESULTS)
+            break;
+    }
+    return n;
+}
+
+/**
+ * multithreaded stress: nthreads threads, each doing nops writes, reads
+ * and deletes at once on STRESSPRIV files of its own and STRESSSHARED
+ * files shared by all, checking all it reads. A private file must read
+ * back as the thread's model of it. Shared files are written in whole
+ * STRESSREC byte records, each holding the writer's pattern for the
+ * (thread, serial) in its first 8 bytes, so a read must see whole records
+ * or zeros (never written, or the file was deleted).
+ */
+#define STRESSPRIV 4
+#define STRESSSHARED 4
+#define STRESSREC 512
+#define STRESSSIZE MAXIO // max file size
+
+long stressErrors;
+
+struct stresser {
+    struct result *r;
+    int id;
+    unsigned int seed;
+    char model[STRESSPRIV][STRESSSIZE];
+    int size[STRESSPRIV]; // -1: no file
+};
+
+void stressFail(struct stresser *st, const char *what, const char *name, int off, int len, int res) {
+    if (__atomic_fetch_add(&stressErrors, 1, __ATOMIC_RELAXED) < 10)
+        fprintf(stderr, "stress: thread %d: %s %s off %d len %d -> %d\n", st->id, what, name, off, len, res);
+}
+
+char stressByte(uint32_t id, uint32_t serial, int i) {
+    return (char) (id * 31 + serial * 7 + i);
+}
+
+/**
+ * one write (kind 0), read (1) or delete (2) of a private/shared file
+ * return: the bytes written or read
+ */
+int stressPrivate(struct stresser *st, int kind, char *data) {
+    int f = rand_r(&st->seed) % STRESSPRIV;
+    char name[16];
+
+    sprintf(name, "P%02d%d", st->id, f);
+    if (kind == 0) {                                        // write
+        int len = 1 + rand_r(&st->seed) % STRESSSIZE;
+        int off = rand_r(&st->seed) % (STRESSSIZE - len + 1);
+        for (int i = 0; i < len; i++)
+            data[i] = (char) rand_r(&st->seed);
+        int res = fs_write(name, data, len, off);
+        if (res != len) {
+            stressFail(st, "write", name, off, len, res);
+            return 0;
+        }
+        if (st->size[f] == -1) {
+            memset(st->model[f], 0, STRESSSIZE);
+            st->size[f] = 0;
+        }
+        memcpy(st->model[f] + off, data, len);
+        if (off + len > st->size[f])
+            st->size[f] = off + len;
+        return len;
+    } else if (kind == 1) {                                 // read
+        int off = rand_r(&st->seed) % STRESSSIZE;
+        int len = 1 + rand_r(&st->seed) % STRESSSIZE;
+        int res = fs_read(name, data, len, off);
+        int want = st->size[f] == -1 ? -1 : off >= st->size[f] ? 0 : st->size[f] - off;
+        if (want > len)
+            want = len;
+        if (res != want || (res > 0 && memcmp(data, st->model[f] + off, res) != 0))
+            stressFail(st, "read", name, off, len, res);
+        return res;
+    } else {                                                // delete
+        int res = fs_delete(name);
+        if (res != (st->size[f] == -1 ? 1 : 0))             // (1: no file)
+            stressFail(st, "delete", name, 0, 0, res);
+        st->size[f] = -1;
+        return 0;
+    }
+}
+
+int stressShared(struct stresser *st, int kind, char *data, uint32_t serial) {
+    int nrec = STRESSSIZE / STRESSREC;
+    int first = rand_r(&st->seed) % nrec;
+    int len = (1 + rand_r(&st->seed) % (nrec - first)) * STRESSREC;
+    int off = first * STRESSREC;
+    char name[16];
+
+    sprintf(name, "S%d", rand_r(&st->seed) % STRESSSHARED);
+    if (kind == 0) {                                        // write
+        for (int rec = 0; rec < len; rec += STRESSREC) {
+            uint32_t head[2] = {(uint32_t) st->id, serial};
+            memcpy(data + rec, head, sizeof(head));
+            for (int i = sizeof(head); i < STRESSREC; i++)
+                data[rec + i] = stressByte(head[0], head[1], i);
+        }
+        int res = fs_write(name, data, len, off);
+        if (res != len)
+            stressFail(st, "write", name, off, len, res);
+        return res;
+    } else if (kind == 1) {                                 // read
+        int res = fs_read(name, data, len, off);
+        if (res == -1)                                      // (deleted)
+            return 0;
+        if (res % STRESSREC != 0) {
+            stressFail(st, "read", name, off, len, res);
+            return res;
+        }
+        for (int rec = 0; rec < res; rec += STRESSREC) {
+            uint32_t head[2];
+            int i = 0;
+            memcpy(head, data + rec, sizeof(head));
+            if (head[0] == 0 && head[1] == 0)               // zeros
+                while (i < STRESSREC && data[rec + i] == 0)
+                    i++;
+            else
+                for (i = sizeof(head); i < STRESSREC && data[rec + i] == stressByte(head[0], head[1], i); i++)
+                    ;
+            if (i < STRESSREC) {
+                stressFail(st, "torn record in", name, off + rec, STRESSREC, res);
+                break;
+            }
+        }
+        return res;
+    }
+    fs_delete(name);                                        // delete
+    return 0;
+}
+
+void *stressThread(void *arg) {
+    struct stresser *st = arg;
+    char data[STRESSSIZE];
+
+    for (int i = 0; i < nops; i++) {
+        int k = rand_r(&st->seed) % 12, bytes;
+        long long t0 = clockNs();
+        if (k < 6) // 3 writes, 2 reads, 1 delete
+            bytes = stressPrivate(st, k < 3 ? 0 : k < 5 ? 1 : 2, data);
+        else       // 2 writes, 3 reads, 1 delete
+            bytes = stressShared(st, k < 8 ? 0 : k < 11 ? 1 : 2, data, (uint32_t) i + 1);
+        st->r->lat[st->id * nops + i] = clockNs() - t0;
+        if (bytes > 0)
+            __atomic_fetch_add(&st->r->bytes, bytes, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+int stress(struct result *r) {
+    pthread_t tids[nthreads];
+    struct stresser *st = calloc(nthreads, sizeof(struct stresser));
+
+    freshDisk();
+    begin(r, "stress", (long) nthreads * nops);
+    for (int t = 0; t < nthreads; t++) {
+        st[t].r = r;
+        st[t].id = t;
+        st[t].seed = (unsigned int) rand();
+        for (int f = 0; f < STRESSPRIV; f++)
+            st[t].size[f] = -1;
+        pthread_create(&tids[t], NULL, stressThread, &st[t]);
+    }
+    for (int t = 0; t < nthreads; t++)
+        pthread_join(tids[t], NULL);
+    r->ops = (long) nthreads * nops;
+    end(r);
+    free(st);
+    if (stressErrors > 0)
+        fprintf(stderr, "stress: %ld wrong results\n", stressErrors);
+    return 1;
+}
+
+/*****************************************************/
+
+int main(int argc, char *argv[]) {
+    struct {
+        const char *name;
+        int (*run)(struct result *); // return: number of results
+    } workloads[] = {
+        {"seqwrite", seqWrite}, {"seqread", seqRead}, {"randrw", randRW},
+        {"churn", churn},       {"mount", mountTime}, {"mtread", mtRead},
+        {"stress", stress},     {"snapshot", snapshot},
+    };
+    int nworkloads = sizeof(workloads) / sizeof(workloads[0]);
+    int selected[16], nselected = 0;
+    int opt, seed = 1;
+
+    while ((opt = getopt(argc, argv, "d:n:o:s:c:Wzb:t:f:")) != -1)
+        switch (opt) {
+        case 'd': image = optarg; break;
+        case 'n': nblocks = atoi(optarg); break;
+        case 'o': nops = atoi(optarg); break;
+        case 's': seed = atoi(optarg); break;
+        case 'c': cacheBlocks = atoi(optarg); break;
+        case 'W': writeThrough = 1; break;
+        case 'z': compress = 1; break;
+        case 'b': blockSize = atoi(optarg); break;
+        case 't': nthreads = atoi(optarg); break;
+        case 'f': format = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-d image] [-n blocks] [-o ops] [-s seed] [-c cacheblocks]"
+                            " [-W] [-z] [-b blocksize] [-t threads] [-f text|csv|json] [workload ...]\n", argv[0]);
+            return 1;
+        }
+    for (int i = optind; i < argc && nselected < 16; i++) {
+        int w;
+        for (w = 0; w < nworkloads && strcmp(argv[i], workloads[w].name) != 0; w++)
+            ;
+        if (w == nworkloads) {
+            fprintf(stderr, "unknown workload %s\n", argv[i]);
+            return 1;
+        }
+        selected[nselected++] = w;
+    }
+    if (nselected == 0)
+        for (nselected = 0; nselected < nworkloads; nselected++)
+            selected[nselected] = nselected;
+
+    if (fs_format_config(blockSize) == -1)
+        return 1;
+    unlink(image); // (scratch image: a new one of nblocks)
+    if (nblocks < 64 || !disk_init(image, nblocks)) {
+        fprintf(stderr, "cannot create disk image %s with %d blocks\n", image, nblocks);
+        return 1;
+    }
+    srand(seed);
+    for (int i = 0; i < MAXIO; i++)
+        buf[i] = 'a' + i % 26;
+
+    if (nthreads < 1)
+        nthreads = 1;
+    for (int i = 0; i < nselected; i++) {
+        struct result r[MAXRESULTS];
+        int n = workloads[selected[i]].run(r);
+        for (int j = 0; j < n; j++) {
+            report(&r[j], "workload", format, i == 0 && j == 0, i == nselected - 1 && j == n - 1);
+            free(r[j].lat);
+        }
+    }
+    quiet(1);
+    fs_unmount();
+    quiet(0);
+    disk_close();
+    return stressErrors > 0 || churnErrors > 0;
+}
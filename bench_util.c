@@ -0,0 +1,79 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+
+long long clockNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int quietStdout = -1;
+
+void quiet(int on) {
+    fflush(stdout);
+    if (on) {
+        int null = open("/dev/null", O_WRONLY);
+        quietStdout = dup(1);
+        dup2(null, 1);
+        close(null);
+    } else {
+        dup2(quietStdout, 1);
+        close(quietStdout);
+    }
+}
+
+/*****************************************************/
+
+static int cmpLong(const void *a, const void *b) {
+    long x = *(const long *) a, y = *(const long *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(struct result *r, double p) {
+    if (r->ops == 0)
+        return 0;
+    return r->lat[(long) (p * (r->ops - 1))] / 1000.0;
+}
+
+void report(struct result *r, const char *key, const char *format, int first, int last) {
+    qsort(r->lat, r->ops, sizeof(long), cmpLong);
+    double ops = r->ops ? r->ops : 1;
+    double fields[] = {
+        r->ops / r->secs, r->bytes / r->secs,
+        percentile(r, 0.5), percentile(r, 0.9), percentile(r, 0.99), percentile(r, 1),
+        r->reads / ops, r->writes / ops,
+    };
+    const char *names[] = {"ops_per_sec", "bytes_per_sec", "p50_us", "p90_us", "p99_us",
+                           "max_us", "reads_per_op", "writes_per_op"};
+    int n = sizeof(fields) / sizeof(fields[0]);
+
+    if (strcmp(format, "csv") == 0) {
+        if (first) {
+            printf("%s,ops", key);
+            for (int i = 0; i < n; i++)
+                printf(",%s", names[i]);
+            putchar('\n');
+        }
+        printf("%s,%ld", r->name, r->ops);
+        for (int i = 0; i < n; i++)
+            printf(",%.3f", fields[i]);
+        putchar('\n');
+    } else if (strcmp(format, "json") == 0) {
+        printf("%s{\"%s\": \"%s\", \"ops\": %ld", first ? "[\n  " : "  ", key, r->name, r->ops);
+        for (int i = 0; i < n; i++)
+            printf(", \"%s\": %.3f", names[i], fields[i]);
+        printf("}%s\n", last ? "\n]" : ",");
+    } else {
+        if (first)
+            printf("%-9s %7s %11s %13s %9s %9s %9s %9s %8s %8s\n", key, "ops",
+                   "ops/s", "bytes/s", "p50(us)", "p90(us)", "p99(us)", "max(us)", "rd/op", "wr/op");
+        printf("%-9s %7ld %11.1f %13.0f %9.1f %9.1f %9.1f %9.1f %8.2f %8.2f\n", r->name, r->ops,
+               fields[0], fields[1], fields[2], fields[3], fields[4], fields[5], fields[6], fields[7]);
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+/*
+ * Timing and reporting shared by bench.c and replay.c
+ */
+
+struct result {
+    const char *name;
+    long ops;
+    long long bytes;
+    double secs;
+    long *lat;   // latency of each op (ns)
+    long maxOps; // lat slots (if grown by the caller)
+    unsigned long reads, writes; // physical disk I/O during the ops
+};
+
+long long clockNs();
+
+/* run fs_format/fs_mount... without their debug output on stdout (on:
+ * 1 to start, 0 to end) */
+void quiet(int on);
+
+/* print result r as a row of a text table, CSV or JSON (format), keyed
+ * by column key; first/last: r is the first/last row (sorts r->lat) */
+void report(struct result *r, const char *key, const char *format, int first, int last);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef DISK_MMAP_H
+#define DISK_MMAP_H
+
+/*
+ * Memory mapped disk images as disk handles for filesystem contexts
+ * (fs_ctx_new), implemented in disk_mmap.c
+ */
+
+struct fs_disk;
+
+struct fs_disk *disk_mmap_open(const char *filename, int nblocks);
+void disk_mmap_close(struct fs_disk *disk);
+
+#endif
@@ -1,16 +1,23 @@
 #include <ctype.h>
 #include <errno.h>
+#include <fnmatch.h>
+#include <limits.h>
 #include <math.h>
+#include <stddef.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 #include <assert.h>
 
 #include "disk.h"
 #include "fs.h"
+#include "fs_ext.h"
 
 #define MIN(X, Y) ((X) > (Y) ? (Y) : (X))
 
@@ -21,22 +28,90 @@
  * 0		| super block (with list of dir blocks)
  * 1		| first data block (usualy with 1st block of dir entries)
  * ...      | other dir blocks and files data blocks
+ *
+ * With FS_F_BITMAP (set by fs_format since the free-space map was added):
+ * 1..B		| allocation bitmap, B = BITMAPBLKS(fssize) (bit b set = block b used)
+ * B+1		| first dir block
+ *
+ * With FS_F_LARGE (large volumes, chosen by fs_format_config) block
+ * numbers are 32 bit and an FS block is 2^blockShift disk blocks (FS block
+ * b is disk blocks b<<blockShift...). The superblock (struct fs_sblock2,
+ * in the first disk block) lists indirect dir blocks, each one a list of
+ * dir blocks, so the directory is not limited by the superblock size.
+ * Such volumes always have FS_F_SIZE32:
+ * 0		| super block (with list of indirect dir blocks)
+ * 1..B		| allocation bitmap
+ * B+1		| first dir block
+ * B+2		| first indirect dir block
+ *
+ * With FS_F_EXT32 (set by fs_format, always with FS_F_SIZE32) extent
+ * dirents hold a 32 bit extent id in .ext; volumes formatted before it
+ * keep 16 bit ids in .ex (and .ss zero).
  */
 
-#define BLOCKSZ (DISK_BLOCK_SIZE)
+#define BLOCKSZ (fs->blockSize) // FS block size (of the mounted disk)
+#define MAXBLOCKSZ 8192   // max FS block size (so an extent is at most 64 KB)
+#define LARGEBLOCKSZ 4096 // FS block size of FS_F_LARGE volumes by default
 #define SBLOCK 0          // superblock is at disk block 0
 #define FS_MAGIC (0xf0f0) // for OFS
+#define FS_MAGIC_MASK (0xf0f0) // other bits of .magic are format features:
+#define FS_F_BITMAP 0x1   // allocation bitmap stored after the superblock
+#define FS_F_DIRTY 0x2    // mounted or crashed: the stored bitmap may be stale
+#define FS_F_SIZE32 0x4   // file size is the 32 bit .size of its TFILE dirent
+#define FS_F_LARGE 0x8    // 32 bit block numbers, FS blocks of many disk blocks
+#define FS_F_EXT32 0x100  // extent id is the 32 bit .ext of its TEXT/TZEXT dirent
 #define FNAMESZ 11        // file name size
 #define LABELSZ 12        // disk label size
 #define MAXDIRSZ 504      // max entries in the directory (1024-4-LABELSZ)/2
+#define SB2INDIRECT 250   // max indirect dir blocks with FS_F_LARGE (<= (1024-20)/4)
+#define MAXDIRENTS (1 << 20) // max dirents in the directory with FS_F_LARGE
 
-#define DIRENTS_PER_BLOCK (BLOCKSZ / sizeof(struct fs_dirent))
+#define DIRENTS_PER_BLOCK (fs->direntsPerBlock)
+#define DIRLISTPB (BLOCKSZ / (int) sizeof(uint32_t)) // dir blocks listed in an indirect block
+#define BITMAPBLKS(n) (((n) + BLOCKSZ * 8 - 1) / (BLOCKSZ * 8)) // bitmap size
 #define FBLOCKS 8 // 8 block indexes in each dirent
 
 /* dirent .st field values: */
 #define TFILE 0x10  // is file dirent
 #define TEMPTY 0x00 // not used/free
 #define TEXT 0xff   // is extent
+#define TINLINE 0x11 // is file dirent of a tiny file, its data in .blocks
+#define TZFILE 0x12 // is file dirent with its extent compressed
+#define TZEXT 0xfe  // is compressed extent
+#define ISFILE(d) ((d)->st == TFILE || (d)->st == TINLINE || (d)->st == TZFILE) // 1st dirent of a file
+#define ISEXT(d) ((d)->st == TEXT || (d)->st == TZEXT)
+#define ISZIP(d) ((d)->st == TZFILE || (d)->st == TZEXT)
+#define ZLEN(d) ((d)->blocks[FBLOCKS - 1]) // compressed length of a TZFILE/TZEXT
+#define BLOCKPTRS(d) ((d)->st == TINLINE ? 0 : ISZIP(d) ? FBLOCKS - 1 : FBLOCKS) // .blocks in use
+#define EXTID(d) ((fs->fsFeatures & FS_F_EXT32) ? (d)->ext : (d)->ex) // id of TEXT/TZEXT dirent d
+
+/* Tiny files (up to INLINESZ bytes, only with FS_F_SIZE32) keep their data
+ * in the .blocks area of a TINLINE dirent, with the size in .size, and have
+ * no extents and no data blocks: reading one needs no I/O besides the
+ * directory (already in memory), and empty files take no block. A write
+ * past INLINESZ moves the data to a block and makes the dirent a TFILE.
+ */
+#define INLINESZ ((int) (FBLOCKS * sizeof(uint16_t))) // (the .blocks of a 16 bit dirent)
+
+/* Compressed extents (fs_compress_config): the EXTSZ bytes of an extent
+ * (zeros past the end of the file) LZ compressed into ZLEN bytes in the
+ * first blocks of a TZFILE/TZEXT dirent, so at most FBLOCKS-1 blocks.
+ * An extent is stored compressed only if that takes fewer blocks than its
+ * non-zero blocks; reading any part of it reads and decompresses it all.
+ */
+#define EXTSZ (FBLOCKS * BLOCKSZ) // bytes of file data in an extent
+#define MAXEXTSZ (FBLOCKS * MAXBLOCKSZ)
+#define LZMINMATCH 4              // shortest match
+#define LZHASHBITS 12             // compressor hash table size (log2)
+
+/* Clones (fs_clone): the dirents of a clone point to the same data blocks
+ * as those of the file cloned, so a block may be in many files. blockRefs
+ * counts its references past the first one; it is rebuilt by mount from the
+ * directory, so clones need nothing else on disk, and only allocated once
+ * some block is shared (4 bytes per block). Freeing a shared block
+ * drops one reference, and a file writes to a shared block by writing a
+ * copy of it (copy-on-write); its other files keep the old one.
+ */
 
 #define FALSE 0
 #define TRUE 1
@@ -46,13 +121,25 @@
 
 /*** FSO Old/Our FileSystem disk layout ***/
 
-struct fs_dirent { // a directory entry (dirent/extent)
+struct fs_dirent { // a directory entry (dirent/extent), as on FS_F_LARGE disks
     uint8_t st;
     char name[FNAMESZ];
-    uint16_t ex; // numb of extra extents or id of this extent
-    uint16_t ss; // number of bytes in the last extent (can be this dirent)
-    uint16_t
-        blocks[FBLOCKS]; // disk blocks with file content (zero value = empty)
+    union {
+        struct {
+            uint16_t ex; // numb of extra extents or id of this extent
+            uint16_t ss; // number of bytes in the last extent (can be this dirent)
+        };
+        uint32_t size; // with FS_F_SIZE32, in TFILE/TINLINE: file size in bytes
+        uint32_t ext;  // with FS_F_EXT32, in TEXT/TZEXT: id of this extent
+    };                 // (else TEXT only uses .ex, see EXTID)
+    uint32_t
+        blocks[FBLOCKS]; // blocks with file content (zero value = hole,
+                         // in TZFILE/TZEXT the last one is ZLEN)
+};
+
+struct fs_dirent16 { // a dirent on disks without FS_F_LARGE
+    uint8_t head[16];         // .st, .name and .ex/.ss/.size as in fs_dirent
+    uint16_t blocks[FBLOCKS]; // (TINLINE: the INLINESZ bytes of data)
 };
 
 struct fs_sblock { // the super block
@@ -62,6 +149,15 @@ struct fs_sblock { // the super block
     uint16_t dir[MAXDIRSZ]; // directory blocks (zero value = empty)
 };
 
+struct fs_sblock2 { // the super block with FS_F_LARGE
+    uint16_t magic;
+    uint16_t blockShift;    // FS block size is DISK_BLOCK_SIZE << blockShift
+    uint32_t fssize;        // total number of FS blocks (including this sblock)
+    char label[LABELSZ];    // disk label
+    uint32_t indirect[SB2INDIRECT]; // indirect dir blocks (zero value = empty), each
+                                    // one with DIRLISTPB directory blocks (zero = empty)
+};
+
 /**
  * Nota: considerando o numero de ordem dos dirent em todos os blocos da
  * directoria um ficheiro pode ser identificado pelo numero do seu dirent. Tal
@@ -70,579 +166,3951 @@ struct fs_sblock { // the super block
 
 union fs_block { // generic fs block. Can be seen with all these formats
     struct fs_sblock super;
-    struct fs_dirent dirent[DIRENTS_PER_BLOCK];
-    char data[BLOCKSZ];
+    struct fs_sblock2 super2;
+    char data[MAXBLOCKSZ]; // (BLOCKSZ of them used)
 };
 
 /*******************************************/
 
-struct fs_sblock superB; // superblock of the mounted disk
+/* All the state of a mounted disk lives in a filesystem context (struct
+ * fs_ctx, opaque to users): any number of contexts, each with its own disk
+ * handle, can be mounted and used at once with no shared mutable state.
+ * The fs.h API uses a default context on the disk.h device.
+ *
+ * Locking: a context may be used by many threads at once (but fs_format,
+ * fs_mount, fs_unmount and the *_config calls must not run concurrently
+ * with any other call on it). Locks are always taken in this order:
+ *   file lock -> dirLock -> allocLock -> superLock -> cacheLock
+ * and mapLock is only held around short extMap table updates (never
+ * while taking another lock).
+ *   - file locks (rwlock, striped by name hash): reads/writes of a file's
+ *     data, dirents and extent map; fs_read/fs_pread take it shared, all
+ *     calls that change the file exclusive (a call on many files takes
+ *     their stripes in increasing order)
+ *   - dirLock (rwlock): the directory index and the set of used dirents;
+ *     changed only by writeFileEntry
+ *   - allocLock: blockBitMap, blockRefs, freeBlocks, allocCursor, fsDirty
+ *   - superLock: dirList, dirIndirect and the blocks listing them on disk
+ *   - cacheLock: the block cache
+ * A block's contents are only read or written under the lock guarding
+ * what it holds (its file's lock, dirLock, allocLock or superLock), so
+ * cache misses read the disk without holding cacheLock.
+ */
+#define FILELOCKS 64 // number of file lock stripes (power of 2)
 
-uint8_t *blockBitMap; // Map of used blocks (not a real bitMap, more a byteMap)
-                      // this is build by mount operation, reading all the directory
+/* In-memory copy of the directory, also built by mount: dirCache holds every
+ * dirent (dirent idx order, so dir block i is at dirCache[i*DIRENTS_PER_BLOCK])
+ * and a hash index maps (encoded name, extent id) to the dirent idx.
+ * writeFileEntry keeps both in sync with the disk, so lookups need no I/O.
+ * dirFree is a lower bound of the free dirent idxs, so adding a dirent does
+ * not scan the used ones again.
+ * dirCache has room for maxDirBlocks blocks and never moves, so the holder
+ * of a file lock may read that file's dirents without dirLock.
+ */
+#define DIRHASHSZ 4096 // min number of hash chains (power of 2)
 
-/*******************************************/
-/* The following functions may be usefull
- * change these and implement others that you need
+/* Extent maps: for recently used files, the dirent idx of each extent and
+ * all data block numbers in file order (file block n is blocks[n], but in
+ * compressed extents).
+ * Built lazily from the directory and patched by writeFileEntry, so mapping
+ * a file offset to a disk block is a single array index.
  */
+#define NEXTMAPS 32 // number of cached extent maps
+#define MAXOPEN 16  // max open file handles (each pins a map, < NEXTMAPS)
 
-/**
- * allocBlock: allocate a new disk block
- * return: block number
+struct extMap {
+    char name[FNAMESZ]; // FS encoded file name
+    unsigned int used;  // LRU stamp (0 = free slot or dropped)
+    int refs;           // open handles and calls using it (not evicted if > 0)
+    int nExt;           // number of extents (see fileExtents)
+    int *dirIdx;        // dirent idx of each extent (-1 = not in directory)
+    uint32_t *blocks;   // nExt*FBLOCKS data blocks (zero value = empty)
+    uint16_t *zLen;     // ZLEN of each extent (0 = not compressed, else its
+                        // blocks above hold compressed data, not file blocks)
+    int nextOffset;     // read-ahead: offset a sequential fs_read would use
+    int raWindow;       // read-ahead window in blocks (0 = random access)
+    int raNext;         // first file block not yet prefetched
+};
+
+/* Block cache: LRU list of FS blocks between the FS and the disk handle.
+ * In write-back mode written blocks stay dirty in memory until evicted or
+ * flushed by fs_sync/fs_unmount; in write-through mode they also go to disk
+ * at once. With no cache slots (not mounted) reads and writes go to disk.
  */
-int allocBlock() {
-    int i;
+#define CACHESZ 64 // default number of cached blocks
+#define RAMIN 4    // first read-ahead window (blocks)
+#define RAMAX 32   // default max read-ahead window (blocks)
 
-    for (i = 0; i < superB.fssize && blockBitMap[i] == NOT_FREE; i++)
-        ;
-    if (i < superB.fssize) {
-        blockBitMap[i] = NOT_FREE;
-        return i;
-    } else
-        return -1; // no disk space
-}
+struct cacheBlock {
+    int block;                       // FS block number (-1 = free slot)
+    int dirty;                       // TRUE if newer than the disk block
+    int prefetched;                  // read ahead and not used yet
+    struct cacheBlock *prev, *next;  // LRU list (cacheLRU.next is the MRU)
+    struct cacheBlock *hnext;        // hash chain
+    char *data;                      // BLOCKSZ bytes (in cacheData)
+};
 
-/**
+/* Asynchronous requests (fs_read_async/fs_write_async) are run by a pool
+ * of worker threads, started by the first one. Requests for the same file
+ * name go, in submission order, to the same lane (chosen by name hash) and
+ * a lane is served by one worker at a time, so requests on a file (e.g.
+ * overlapping writes) complete in order; other lanes run in parallel,
+ * keeping many block transfers in flight.
  */
-void freeBlock(int nblock) {
-    blockBitMap[nblock] = FREE;
-}
+#define AIOMAX 256    // max requests not yet released (see aioSubmit)
+#define AIOLANES 64   // number of lanes (power of 2)
+#define AIOWORKERS 8  // worker threads
 
-/**
- * copy str to dst, converting from C string to FS string:
- *   - uppercase letters and ending with spaces
- * dst and str must exist with at least len chars
+struct aioReq {
+    int id;                  // request id (0 = free slot)
+    int write;               // TRUE for fs_write, else fs_read
+    char name[FNAMESZ + 1];  // file name (C string)
+    char *data;
+    int length, offset;
+    fs_aio_callback cb;      // called when done (then the slot is freed)
+    void *arg;
+    int result;              // of the fs_read/fs_write
+    int done;                // TRUE when result is set
+    struct aioReq *next;     // next request in the lane
+};
+
+struct aioLane {
+    struct aioReq *head, *tail; // FIFO of requests (head is the next one)
+    int busy;                   // a worker is running the head request
+    struct aioLane *nextReady;  // list of lanes waiting for a worker
+};
+
+struct fs_ctx {
+    struct fs_disk *disk;    // the disk device
+    struct fs_ctx *nextCtx;  // list of all contexts (for fsAtExit)
+
+    pthread_rwlock_t fileLocks[FILELOCKS];
+    pthread_rwlock_t dirLock;
+    pthread_mutex_t allocLock;
+    pthread_mutex_t superLock;
+    pthread_mutex_t cacheLock;
+    pthread_mutex_t mapLock;
+    pthread_cond_t mapFree;  // an extent map was unpinned
+
+    struct fs_sblock superB; // superblock of the mounted disk (.magic is FS_MAGIC,
+                             // its feature bits are in fsFeatures; .fssize and .dir
+                             // are in fsBlocks and dirList)
+    int fsFeatures;          // FS_F_* bits of the mounted disk (but FS_F_DIRTY)
+    int fsDirty;             // TRUE if FS_F_DIRTY is set on disk
+    int fsBlocks;            // total number of FS blocks
+    int blockSize;           // FS block size (BLOCKSZ), DISK_BLOCK_SIZE << blockShift
+    int blockShift;
+    int direntsPerBlock;     // dirents in a dir block (on disk)
+    int formatBlockSize;     // FS block size fs_format uses (0 = by disk size)
+
+    uint64_t *blockBitMap; // Map of used blocks (bit set = NOT_FREE), 64 per word
+                           // this is build by mount operation, reading all the directory
+                           // or loaded from the disk (with BITMAPBLKS blocks of memory)
+                           // (bits past the end of the disk are kept set)
+    int bitMapWords;       // number of words in blockBitMap
+    int freeBlocks;        // number of FREE blocks in blockBitMap
+    int allocCursor;       // next-fit: allocBlock starts searching here
+    uint32_t *blockRefs;   // references to each block besides the first one
+                           // (files sharing it, see fsClone), built by mount
+                           // (NULL while no block is shared)
+
+    struct fs_dirent *dirCache; // all dirents of the directory
+    int *dirHashNext;           // dirent idx -> next idx in the same chain (-1 ends)
+    int *dirHashHead;           // chain -> first dirent idx (-1 if empty)
+    int dirHashSz;              // number of hash chains (power of 2)
+    int dirBlocks;              // number of directory blocks in dirCache
+    int dirFree;                // no free dirent below this idx (dirLock)
+    int maxDirBlocks;           // max directory blocks
+    uint32_t *dirList;          // directory blocks (zero value = empty)
+    uint32_t dirIndirect[SB2INDIRECT]; // FS_F_LARGE: blocks with dirList (see fs_sblock2)
+
+    struct extMap extMaps[NEXTMAPS];
+    struct extMap *openFiles[MAXOPEN]; // handle -> map of the open file (NULL = free)
+    unsigned int extMapClock; // last LRU stamp used
+    int defragNext;           // dirent idx where the next fs_defrag call goes on
+
+    struct cacheBlock *cacheSlots;   // all cache slots
+    char *cacheData;                 // their blocks
+    struct cacheBlock **cacheHash;   // block % cacheHashSz -> chain of slots
+    struct cacheBlock cacheLRU;      // list head of the LRU list
+    int cacheSize;                   // configured number of slots
+    int cacheHashSz;                 // number of hash chains (power of 2)
+    int cacheWriteThrough;           // write mode
+    int raMax;                       // max read-ahead window (blocks, 0 = none)
+    int compress;                    // TRUE: store full extents compressed
+    struct fs_cache_stats cacheStats;
+
+    struct fs_stats fsStats;
+
+    pthread_mutex_t aioLock;  // all the aio fields
+    pthread_cond_t aioWork;   // a lane is ready (or the workers must stop)
+    pthread_cond_t aioDone;   // a request completed
+    struct aioReq aioReqs[AIOMAX]; // request id % AIOMAX is its slot
+    struct aioLane aioLanes[AIOLANES];
+    struct aioLane *aioReady, *aioReadyTail; // lanes waiting for a worker
+    pthread_t aioWorkers[AIOWORKERS];
+    int aioNWorkers;          // workers started
+    int aioPending;           // requests submitted and not done
+    int aioCallbacks;         // callbacks running (their slots are freed after)
+    int aioSeq;               // last request sequence number
+    int aioStop;              // TRUE: workers exit when no lane is ready
+
+    pthread_mutex_t traceLock; // traceFile writes
+    FILE *traceFile;           // call trace being recorded (NULL = off)
+    long long traceT0;         // its start (nowNs)
+};
+
+/* Runtime statistics (fs_stats): counters are relaxed atomic increments
+ * and each public call reads the clock twice, so they are always on.
+ * Physical I/O is charged to curOp, the public call running in this
+ * thread (write-back blocks to the call that flushes them).
  */
-void strEncode(char *dst, char *str, int len) {
-    int i;
-    for (i = 0; i < len && str[i] != '\0'; i++)
-        if (isalpha(str[i]))
-            dst[i] = toupper(str[i]);
-        else if (isdigit(str[i]) || str[i] == '_' || str[i] == '.')
-            dst[i] = str[i];
-        else
-            dst[i] = '?'; // invalid char?
-    for (; i < len; i++)
-        dst[i] = ' '; // fill with space
+#define STAT_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
 
+__thread int curOp = FS_OP_OTHER;
+__thread struct fs_ctx *aioWorkerOf; // context of the aio worker thread (else NULL)
+
+static long long nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
 /**
- * copy str to dst, converting from FS string to C string
- * dst must exist with at least len+1 chars
+ * start/end of public call op: count it and its latency (log2 histogram)
  */
-void strDecode(char *dst, const char *str, int len) {
-    int i;
-    for (i = len - 1; i > 0 && str[i] == ' '; i--)
-        ;
-    dst[i + 1] = '\0';
-    for (; i >= 0; i--)
-        dst[i] = str[i];
+static long long opBegin(struct fs_ctx *fs, int op) {
+    curOp = op;
+    STAT_ADD(fs->fsStats.calls[op], 1);
+    return nowNs();
+}
+
+static void opEnd(struct fs_ctx *fs, int op, long long t0) {
+    long long ns = nowNs() - t0;
+    int bucket = ns > 1 ? 63 - __builtin_clzll((unsigned long long) ns) : 0;
+    STAT_ADD(fs->fsStats.latency[op][MIN(bucket, FS_HIST_BUCKETS - 1)], 1);
+    curOp = FS_OP_OTHER;
 }
 
+/* Call tracing (fs_trace_start): each public call that ends appends a
+ * struct fs_trace_rec to traceFile (under traceLock, stdio buffered).
+ * With tracing off a call only pays one atomic load of traceFile.
+ */
+
 /**
- * print super block content to stdout (for debug)
+ * trace public call op started at t0 (name and name2, the second name of
+ * fs_clone, may be NULL)
  */
-void dumpSB() {
-    union fs_block block;
-    char label[LABELSZ + 1];
+void traceRecord(struct fs_ctx *fs, int op, long long t0, const char *name, const char *name2,
+                 int offset, int length, int fd, int result) {
+    struct fs_trace_rec rec;
 
-    disk_read(SBLOCK, block.data);
-    printf("superblock:\n");
-    printf("    magic = %x\n", block.super.magic);
-    printf("    %d blocks\n", block.super.fssize);
-    printf("    dir_size: %d\n", MAXDIRSZ);
-    printf("    first dir block: %d\n", block.super.dir[0]);
-    strDecode(label, block.super.label, LABELSZ);
-    printf("    disk label: %s\n", label);
+    if (__atomic_load_n(&fs->traceFile, __ATOMIC_ACQUIRE) == NULL)
+        return;
+    memset(&rec, 0, sizeof(rec));
+    rec.time = (uint64_t) (t0 - fs->traceT0);
+    rec.offset = offset;
+    rec.length = length;
+    rec.fd = fd;
+    rec.result = result;
+    rec.op = (uint8_t) op;
+    if (name != NULL)                                       // (fixed width, no '\0' if full)
+        memcpy(rec.name, name, strnlen(name, sizeof(rec.name)));
+    if (name2 != NULL)
+        memcpy(rec.name2, name2, strnlen(name2, sizeof(rec.name2)));
+    pthread_mutex_lock(&fs->traceLock);
+    if (fs->traceFile != NULL)                              // (may have stopped meanwhile)
+        fwrite(&rec, sizeof(rec), 1, fs->traceFile);
+    pthread_mutex_unlock(&fs->traceLock);
+}
 
-    printf("dir blocks: ");
-    for (int i = 0; block.super.dir[i] != 0; i++)
-        printf("%d ", block.super.dir[i]);
-    putchar('\n');
+void traceCall(struct fs_ctx *fs, int op, long long t0, const char *name,
+               int offset, int length, int fd, int result) {
+    traceRecord(fs, op, t0, name, NULL, offset, length, fd, result);
 }
 
 /**
- * search and read file dirent/extent:
- * 	if ext==0: find 1st entry (with .st=TFILE)
- * 	if ext>0:  find extent (with .st=TEXT) and .ex==ext
- *  if ent!=NULL fill it with a copy of the dirent/extent
- *  return dirent index in the directory (or -1 if not found)
+ * count a physical transfer of nblocks disk blocks
  */
-int readFileEntry(char *name, uint16_t ext, struct fs_dirent *ent) {
-    union fs_block block;
-
-    for (int dirblk = 0; dirblk < MAXDIRSZ && superB.dir[dirblk]; dirblk++) {
-        int b = superB.dir[dirblk];
-        disk_read((unsigned int) b, block.data);
-        for (int j = 0; j < DIRENTS_PER_BLOCK; j++)
-            if ((((ext == 0 && block.dirent[j].st == TFILE)) &&
-                 strncmp(block.dirent[j].name, name, FNAMESZ) == 0) ||
-                (((block.dirent[j].st == TEXT && block.dirent[j].ex == ext)) &&
-                 strncmp(block.dirent[j].name, name, FNAMESZ) == 0)) {
-                if (ent != NULL)
-                    *ent = block.dirent[j];
-                return dirblk * DIRENTS_PER_BLOCK + j; // this dirent index
-            }
+void ioDone(struct fs_ctx *fs, int write, int nblocks) {
+    if (write) {
+        STAT_ADD(fs->cacheStats.writes, 1);
+        STAT_ADD(fs->fsStats.blockWrites[curOp], nblocks);
+    } else {
+        STAT_ADD(fs->cacheStats.reads, 1);
+        STAT_ADD(fs->fsStats.blockReads[curOp], nblocks);
     }
-
-    return -1;
 }
 
 /**
- * update dirent at idx with 'entry' or, if idx==-1, add a new dirent to
- * directory with 'entry' content.
- * return: idx used/allocated, -1 if error (no space in directory)
+ * copy n counters from src to dst (each read atomically)
+ */
+void statsLoad(unsigned long *dst, unsigned long *src, int n) {
+    for (int i = 0; i < n; i++)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+/* Vectored block I/O: a list of (block, buffer) pairs is sorted and each
+ * run of consecutive disk blocks becomes a single transfer, if the disk
+ * handle provides readv/writev (nblocks consecutive blocks from 'first'
+ * to/from the iov buffers, as preadv/pwritev on the disk image).
+ * Otherwise each block is transferred with read/write.
  */
-int writeFileEntry(int idx, struct fs_dirent entry) {
+#define VECMAX 64 // max pairs in one request (and blocks in one transfer)
 
-    // TODO: (if needed)
+struct blockVec {
+    int block; // disk block number
+    char *buf; // BLOCKSZ bytes buffer
+};
 
-    // update dirent idx or allocate a new one
-    // and write to directory on disk
+/* The default context (used by the fs.h API) has the disk.h device as its
+ * disk handle. disk.h backends may also provide disk_readv/disk_writev
+ * and, if they map the disk image in memory (disk_mmap.c), lend read-only
+ * pointers to blocks, so reads can copy straight from the mapping, and
+ * sync the mapping to the image file.
+ */
+void disk_readv(int first, const struct iovec *iov, int nblocks) __attribute__((weak));
+void disk_writev(int first, const struct iovec *iov, int nblocks) __attribute__((weak));
+const char *disk_borrow(int blocknum) __attribute__((weak));
+void disk_msync() __attribute__((weak));
 
-    // notice: directory may need to grow!!
-    union fs_block block;
-    int blockNumber;
-    if(idx == -1) {
-        for(int i = 0; i < MAXDIRSZ && superB.dir[i]; i++) {
-            int b = superB.dir[i];
-            disk_read((unsigned int) b, block.data);
-            for(int j = 0; j < DIRENTS_PER_BLOCK; j++) {
-                if(block.dirent[j].st == TEMPTY) {
-                    block.dirent[j] = entry;
-                    disk_write((unsigned int) b, block.data);
-                    return i * DIRENTS_PER_BLOCK + j;
-                }
-            }
-        }
-        blockNumber = allocBlock();
-        if(blockNumber == -1)
-            return -1;
-        disk_read((unsigned int) blockNumber, block.data);
-        block.dirent[0] = entry;
-        int i;
-        for(i = 0; i < MAXDIRSZ && superB.dir[i]; i++);
-        superB.dir[i] =(uint16_t) blockNumber;
-        union fs_block super =(union fs_block) superB;
-        disk_write(0,super.data);
-        disk_write((unsigned int) blockNumber, block.data);
-        return readFileEntry(entry.name,entry.ex,&entry);
-    } else {
-        int numberBlock = idx / DIRENTS_PER_BLOCK;
-        disk_read(superB.dir[numberBlock],block.data);
-        block.dirent[idx-numberBlock*DIRENTS_PER_BLOCK] = entry;
-        disk_write(superB.dir[numberBlock],block.data);
-        return idx;
-    }
+int stdSize(struct fs_disk *d) {
+    (void) d;
+    return disk_size();
 }
 
-/****************************************************************/
+void stdRead(struct fs_disk *d, int block, char *data) {
+    (void) d;
+    disk_read(block, data);
+}
 
-int fs_delete(char *name) {
+void stdWrite(struct fs_disk *d, int block, const char *data) {
+    (void) d;
+    disk_write(block, data);
+}
 
-    if (superB.magic != FS_MAGIC) {
-        printf("disc not mounted\n");
-        return -1;
-    }
-    char fname[FNAMESZ];
-    strEncode(fname, name, FNAMESZ);
+void stdReadv(struct fs_disk *d, int first, const struct iovec *iov, int nblocks) {
+    (void) d;
+    disk_readv(first, iov, nblocks);
+}
 
-    // TODO: delete file: free it's dirent, extents and data blocks
-    union fs_block block;
-    memset(block.data,FREE,BLOCKSZ);
-    struct fs_dirent* entry = &block.dirent[0];
-    int result = 1;
-    int idx;
-    int ext = 0;
-    while(1) {
-        if ((idx = readFileEntry(fname, (uint16_t) ext++, entry)) != -1) {
-            result = 0;
-            for (int j = 0; j < FBLOCKS && entry->blocks[j]; j++) {
-                freeBlock(entry->blocks[j]);
-                entry->blocks[j] = FREE;
-            }
-            entry->st = TEMPTY;
-            memset(entry,FREE, sizeof(struct fs_dirent));
-            writeFileEntry(idx, *(entry));
-        } else
-            return result;
-    }
+void stdWritev(struct fs_disk *d, int first, const struct iovec *iov, int nblocks) {
+    (void) d;
+    disk_writev(first, iov, nblocks);
 }
 
-/*****************************************************/
+const char *stdBorrow(struct fs_disk *d, int block) {
+    (void) d;
+    return disk_borrow(block);
+}
 
-void fs_dir() {
+void stdMsync(struct fs_disk *d) {
+    (void) d;
+    disk_msync();
+}
 
-    if (superB.magic != FS_MAGIC) {
-        printf("disc not mounted\n");
-        return;
-    }
+struct fs_disk stdDisk; // disk handle of the default context
 
-    // TODO: list files
-    // printf( "%u: %s, size: %u bytes\n", dirent_number, file_name, file_size)
+/* FS blocks on disk: FS block b is the 1 << blockShift disk blocks from
+ * b << blockShift, moved in one vectored transfer if the disk handle can.
+ */
+#define DISKVECMAX (MAXBLOCKSZ / DISK_BLOCK_SIZE) // disk blocks in an FS block (max)
 
-    union fs_block block;
-    for(unsigned int i = 0; i < MAXDIRSZ && superB.dir[i]; i++) {
-        disk_read(superB.dir[i],block.data);
-        for(int j = 0; j < DIRENTS_PER_BLOCK; j++) {
-          struct fs_dirent dirent = block.dirent[j];
-          if(dirent.st == TFILE) {
-              char file_name[FNAMESZ + 1];
-              strDecode(file_name, dirent.name, FNAMESZ);
-              uint16_t file_size = (uint16_t) (dirent.ex *FBLOCKS *BLOCKSZ + dirent.ss);
-              uint16_t dirent_number = (uint16_t) (i * DIRENTS_PER_BLOCK + j);
-              printf("%u: %s, size: %u bytes\n", dirent_number, file_name, file_size);
-          }
-      }
+/**
+ * read (if write==FALSE) or write FS block b from/to data
+ */
+void diskIO(struct fs_ctx *fs, int b, char *data, int write) {
+    int n = 1 << fs->blockShift, first = b << fs->blockShift;
+
+    if (n > 1 && (write ? fs->disk->writev != NULL : fs->disk->readv != NULL)) {
+        struct iovec iov[DISKVECMAX];
+        for (int i = 0; i < n; i++) {
+            iov[i].iov_base = data + i * DISK_BLOCK_SIZE;
+            iov[i].iov_len = DISK_BLOCK_SIZE;
+        }
+        if (write)
+            fs->disk->writev(fs->disk, first, iov, n);
+        else
+            fs->disk->readv(fs->disk, first, iov, n);
+        ioDone(fs, write, n);
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        if (write)
+            fs->disk->write(fs->disk, first + i, data + i * DISK_BLOCK_SIZE);
+        else
+            fs->disk->read(fs->disk, first + i, data + i * DISK_BLOCK_SIZE);
+        ioDone(fs, write, 1);
     }
 }
-/*****************************************************/
 
-void fs_debug() {
-    union fs_block block;
+/**
+ * return: read-only pointer to the n bytes at offset off of FS block b in
+ * the disk mapping, or NULL if the disk backend does not lend them (in
+ * consecutive memory)
+ */
+const char *diskBorrow(struct fs_ctx *fs, int b, int off, int n) {
+    if (fs->disk->borrow == NULL)
+        return NULL;
+    int first = (b << fs->blockShift) + off / DISK_BLOCK_SIZE;
+    int last = (b << fs->blockShift) + (off + n - 1) / DISK_BLOCK_SIZE;
+    const char *p = fs->disk->borrow(fs->disk, first);
+    if (p == NULL || (last != first &&
+                      fs->disk->borrow(fs->disk, last) != p + (last - first) * DISK_BLOCK_SIZE))
+        return NULL;
+    return p + off % DISK_BLOCK_SIZE;
+}
 
-    disk_read(SBLOCK, block.data);
+/*******************************************/
+/* The following functions may be usefull
+ * change these and implement others that you need
+ */
 
-    if (block.super.magic != FS_MAGIC) {
-        printf("disk unformatted !\n");
-        return;
-    }
-    dumpSB();
+/**
+ * link/unlink cache slot c at the MRU end of the LRU list
+ */
+void cacheLink(struct fs_ctx *fs, struct cacheBlock *c) {
+    c->prev = &fs->cacheLRU;
+    c->next = fs->cacheLRU.next;
+    fs->cacheLRU.next->prev = c;
+    fs->cacheLRU.next = c;
+}
 
-    printf("**************************************\n");
-    if (superB.magic == FS_MAGIC) {
-        printf("Used blocks: ");
-        for (int i = 0; i < superB.fssize; i++) {
-            if (blockBitMap[i] == NOT_FREE)
-                printf(" %d", i);
-        }
-        puts("\nFiles:\n");
-        fs_dir();
-    }
-    printf("**************************************\n");
+void cacheUnlink(struct cacheBlock *c) {
+    c->prev->next = c->next;
+    c->next->prev = c->prev;
 }
 
-/*****************************************************/
+/**
+ * return: cache slot with disk block b, or NULL (cacheLock held)
+ */
+struct cacheBlock *cacheSlot(struct fs_ctx *fs, int b) {
+    struct cacheBlock *c;
 
-int fs_format(char *disklabel) {
-    union fs_block block;
-    int nblocks;
+    for (c = fs->cacheHash[b & (fs->cacheHashSz - 1)]; c != NULL && c->block != b; c = c->hnext)
+        ;
+    return c;
+}
 
-    assert(sizeof(struct fs_dirent) == 32);
-    assert(sizeof(union fs_block) == BLOCKSZ);
+/**
+ * return: cache slot with disk block b (moved to MRU), or NULL (cacheLock held)
+ */
+struct cacheBlock *cacheFind(struct fs_ctx *fs, int b) {
+    struct cacheBlock *c = cacheSlot(fs, b);
 
-    if (superB.magic == FS_MAGIC) {
-        printf("Cannot format a mounted disk!\n");
-        return 0;
-    }
-    if (sizeof(block) != DISK_BLOCK_SIZE) {
-        printf("Disk block and FS block mismatch\n");
-        return 0;
+    if (c != NULL) {
+        cacheUnlink(c);
+        cacheLink(fs, c);
+        if (c->prefetched) {
+            STAT_ADD(fs->cacheStats.prefetchHits, 1);
+            c->prefetched = FALSE;
+        }
     }
-    memset(&block, 0, sizeof(block));
-    disk_write(1, block.data); // write 1st dir block all zeros
+    return c;
+}
 
-    nblocks = disk_size();
-    block.super.magic = FS_MAGIC;
-    block.super.fssize = nblocks;
-    strEncode(block.super.label, disklabel, LABELSZ);
-    block.super.dir[0] = 1; // block 1 is first dir block
+/**
+ * write cache slot c to disk if dirty (cacheLock held)
+ */
+void cacheClean(struct fs_ctx *fs, struct cacheBlock *c) {
+    if (c->dirty) {
+        diskIO(fs, c->block, c->data, TRUE);
+        c->dirty = FALSE;
+    }
+}
 
-    disk_write(0, block.data);  // write superblock
-    dumpSB(); // debug
+/**
+ * get a slot for FS block b (not cached), evicting the LRU block (cacheLock held)
+ */
+struct cacheBlock *cacheNew(struct fs_ctx *fs, int b) {
+    struct cacheBlock *c = fs->cacheLRU.prev;
 
-    return 1;
+    if (c->block != -1) {
+        cacheClean(fs, c);
+        struct cacheBlock **p = &fs->cacheHash[c->block & (fs->cacheHashSz - 1)];
+        while (*p != c)
+            p = &(*p)->hnext;
+        *p = c->hnext;
+        STAT_ADD(fs->cacheStats.evictions, 1);
+    }
+    c->block = b;
+    c->prefetched = FALSE;
+    c->hnext = fs->cacheHash[b & (fs->cacheHashSz - 1)];
+    fs->cacheHash[b & (fs->cacheHashSz - 1)] = c;
+    cacheUnlink(c);
+    cacheLink(fs, c);
+    return c;
 }
 
-/*****************************************************************/
-
-int fs_mount() {
-    union fs_block block;
+/**
+ * read/write FS block b through the cache. A miss reads the disk
+ * without cacheLock, so misses of other threads are not serialized.
+ */
+void cacheRead(struct fs_ctx *fs, int b, char *data) {
+    struct cacheBlock *c;
 
-    if (superB.magic == FS_MAGIC) {
-        printf("One disc is already mounted!\n");
-        return 0;
+    if (fs->cacheSlots == NULL) {
+        diskIO(fs, b, data, FALSE);
+        return;
+    }
+    pthread_mutex_lock(&fs->cacheLock);
+    if ((c = cacheFind(fs, b)) != NULL) {
+        STAT_ADD(fs->cacheStats.hits, 1);
+        memcpy(data, c->data, BLOCKSZ);
+        pthread_mutex_unlock(&fs->cacheLock);
+        return;
     }
-    disk_read(0, block.data);
-    superB = block.super;
+    STAT_ADD(fs->cacheStats.misses, 1);
+    pthread_mutex_unlock(&fs->cacheLock);
+    diskIO(fs, b, data, FALSE);
+    pthread_mutex_lock(&fs->cacheLock);
+    if ((c = cacheSlot(fs, b)) == NULL) { // else another reader loaded it meanwhile
+        c = cacheNew(fs, b);
+        memcpy(c->data, data, BLOCKSZ);
+        c->dirty = FALSE;
+    }
+    pthread_mutex_unlock(&fs->cacheLock);
+}
 
-    if (superB.magic != FS_MAGIC) {
-        printf("cannot mount an unformatted disc!\n");
-        return 0;
+void cacheWrite(struct fs_ctx *fs, int b, const char *data) {
+    struct cacheBlock *c;
+
+    if (fs->cacheSlots == NULL) {
+        diskIO(fs, b, (char *) data, TRUE);
+        return;
     }
-    if (superB.fssize != disk_size()) {
-        printf("file system size and disk size differ!\n");
-        return 0;
+    pthread_mutex_lock(&fs->cacheLock);
+    if ((c = cacheFind(fs, b)) != NULL)
+        STAT_ADD(fs->cacheStats.hits, 1);
+    else {
+        STAT_ADD(fs->cacheStats.misses, 1);
+        c = cacheNew(fs, b);
     }
+    memcpy(c->data, data, BLOCKSZ);
+    c->dirty = TRUE;
+    if (fs->cacheWriteThrough)
+        cacheClean(fs, c);
+    pthread_mutex_unlock(&fs->cacheLock);
+}
+
+/**
+ * whole block access only if disk block b is cached:
+ * cacheLookup copies it to data, cacheUpdate replaces it with data
+ * return: TRUE if b was cached
+ */
+int cacheLookup(struct fs_ctx *fs, int b, char *data) {
+    struct cacheBlock *c;
 
-    // build used blocks map
-    blockBitMap = malloc(superB.fssize * sizeof(uint16_t));
-    memset(blockBitMap,FREE,superB.fssize * sizeof(uint16_t));
-    blockBitMap[0] = NOT_FREE; // 0 is used by superblock
+    if (fs->cacheSlots == NULL)
+        return FALSE;
+    pthread_mutex_lock(&fs->cacheLock);
+    if ((c = cacheFind(fs, b)) != NULL) {
+        STAT_ADD(fs->cacheStats.hits, 1);
+        memcpy(data, c->data, BLOCKSZ);
+    }
+    pthread_mutex_unlock(&fs->cacheLock);
+    return c != NULL;
+}
 
-    // TODO: blockBitMap[i]=NOT_FREE if block i is in use
-    //       check all directory
+/**
+ * copy n bytes at offset off of disk block b to dst, from the cache or, if
+ * not cached and the disk backend lends blocks, from the disk mapping
+ * return: TRUE if copied, FALSE if b must be read
+ */
+int blockCopy(struct fs_ctx *fs, int b, char *dst, int off, int n) {
+    struct cacheBlock *c = NULL;
 
-    union fs_block tempBlock;
-    for(int i = 0; i < MAXDIRSZ && superB.dir[i]; i++) {
-        blockBitMap[superB.dir[i]] = NOT_FREE;
-        disk_read(superB.dir[i], tempBlock.data);
-        for (unsigned int j = 0; j < DIRENTS_PER_BLOCK; j++) {
-            struct fs_dirent dirent = tempBlock.dirent[j];
-            if (dirent.st == TEXT || dirent.st == TFILE)
-                for (int k = 0; k < FBLOCKS && tempBlock.dirent[j].blocks[k]; k++)
-                    blockBitMap[tempBlock.dirent[j].blocks[k]] = NOT_FREE;
+    if (fs->cacheSlots != NULL) {
+        pthread_mutex_lock(&fs->cacheLock);
+        if ((c = cacheFind(fs, b)) != NULL) {
+            STAT_ADD(fs->cacheStats.hits, 1);
+            memcpy(dst, c->data + off, n);
         }
+        pthread_mutex_unlock(&fs->cacheLock);
     }
-    return 1;
+    if (c == NULL) {
+        const char *p = diskBorrow(fs, b, off, n);
+        if (p == NULL)
+            return FALSE;
+        memcpy(dst, p, n);
+    }
+    return TRUE;
 }
 
-/************************************************************/
-
-int fs_read(char *name, char *data, int length, int offset) {
+int cacheUpdate(struct fs_ctx *fs, int b, const char *data) {
+    struct cacheBlock *c;
 
-    if (superB.magic != FS_MAGIC) {
-        printf("disc not mounted\n");
-        return -1;
+    if (fs->cacheSlots == NULL)
+        return FALSE;
+    pthread_mutex_lock(&fs->cacheLock);
+    if ((c = cacheFind(fs, b)) != NULL) {
+        STAT_ADD(fs->cacheStats.hits, 1);
+        memcpy(c->data, data, BLOCKSZ);
+        c->dirty = TRUE;
+        if (fs->cacheWriteThrough)
+            cacheClean(fs, c);
     }
-    char fname[FNAMESZ];
-    strEncode(fname, name, FNAMESZ);
+    pthread_mutex_unlock(&fs->cacheLock);
+    return c != NULL;
+}
 
-    // TODO: read file data
-
-    int blockNOfFile = offset/BLOCKSZ;                                                          // numero do bloco do ficheiro (como se houvesse um vetor de blocos de ficheiro).
-    int blockNumberEntry = blockNOfFile % FBLOCKS;                                              // numero do bloco da entrada a ser lida (dirent.blocks[]).
-    int extent = blockNOfFile /FBLOCKS;
-    int firstBlockOffset = offset % BLOCKSZ;                                                    // o offset do primeiro bloco a ser lido.
-    int numberOfBlocksToRead = (length + firstBlockOffset)/BLOCKSZ +1;                          // numero de blocos a ler (regras do disco: so pode ser lido um bloco de cada vez).
-    int lastBlockOffset = (length + offset) - BLOCKSZ*(blockNOfFile + numberOfBlocksToRead -1); // o offset do ultimo bloco (numero de bytes a ler do ultimo bloco).
-    int incompleteBlockIdx;                                                                     // index do primeiro bloco da entry incompleto
-    union fs_block block;                                                                       // bloco geral pra dados
-    memset(block.data,FREE,BLOCKSZ);
-    struct fs_dirent entry = block.dirent[0];                                                   // entrada geral pra leitura de entradas
-    struct fs_dirent firstFileEntry = entry;
-    int bytesRead = 0;
-    int numberOfBlocksRead = 0;
-    if(readFileEntry(fname,0,&firstFileEntry) == -1)                                                     // FILE DOES NOT EXIST
-        return -1;
-    readFileEntry(fname, (uint16_t) extent, &entry);
-    disk_read(entry.blocks[blockNumberEntry], block.data);
-    int fileSize = firstFileEntry.ex *FBLOCKS *BLOCKSZ + firstFileEntry.ss;  // total size of the file (including extents)
-    if (offset == fileSize)
-        return 0;
-     if (extent == firstFileEntry.ex && (firstFileEntry.ss % BLOCKSZ))
-         incompleteBlockIdx = firstFileEntry.ss / BLOCKSZ;                  // defining the last block of the last entry
-     else
-         incompleteBlockIdx = FBLOCKS-1;
-
-     int fileFinalOffset;                              // LastBlockOffset mas do ficheiro em vez do ultimo bloco para ser lido.
-     if(firstFileEntry.ss%BLOCKSZ)
-         fileFinalOffset = firstFileEntry.ss - (firstFileEntry.ss /BLOCKSZ)*BLOCKSZ;
-     else
-         fileFinalOffset = firstFileEntry.ss - (firstFileEntry.ss /BLOCKSZ-1) *BLOCKSZ;
-     if (incompleteBlockIdx == blockNumberEntry && extent == firstFileEntry.ex) {                      // FIRST BLOCK TO READ IS INCOMPLETE OR ENTRY ONLY HAS ONE BLOCK
-         int i;
-         if(offset +length > fileSize)
-             for (i = firstBlockOffset; i < fileFinalOffset; i++) {   // READ UNTIL THE FILE ENDS
-                 data[i-firstBlockOffset] = block.data[i];
-                 bytesRead++;
-             }
-         else
-            for (i = firstBlockOffset; i < lastBlockOffset; i++) {   // READ THE BYTES ASKED TO BE READ ENDS
-                data[i-firstBlockOffset] = block.data[i];
-             bytesRead++;
-         }
-         return bytesRead;                   // FILE IS NOT FINISHED
-     }
-     int i;
-     for (i = 0; i < BLOCKSZ - firstBlockOffset && bytesRead < length; i++)        // FIRST BLOCK TO READ
-         data[i] = block.data[firstBlockOffset + i];
-     bytesRead += i;
-     blockNumberEntry++;
-     numberOfBlocksRead++;
-     for (; blockNumberEntry < FBLOCKS && numberOfBlocksRead < numberOfBlocksToRead; blockNumberEntry++) {  // EVERY BLOCK TO READ UNTIL BYTES == LENGTH OR FILE ENDS
-         if (entry.blocks[blockNumberEntry] == 0)    // BLOCK NON EXISTENT FILE ENDS HERE
-             return bytesRead;
-         disk_read(entry.blocks[blockNumberEntry], block.data);
-         int j;
-         if (blockNumberEntry != incompleteBlockIdx)                             // BLOCK TO BE READ IS INCOMPLETE
-             for (j = 0; j < BLOCKSZ && bytesRead < length; j++)
-                    data[bytesRead++] = block.data[j];
-         else                                                   // BLOCK IS TO BE READ FULLY OR UNTIL DATA IS FULL
-            for (j = 0; j < fileFinalOffset && j < lastBlockOffset && bytesRead < length; j++)
-                data[bytesRead++] = block.data[j];
-         numberOfBlocksRead++;
-     }
-     if (bytesRead + offset == fileSize || blockNumberEntry == FBLOCKS)                 // se ja acabou o ficheiro
-         return bytesRead;
+int cacheCmp(const void *a, const void *b) {
+    return (*(struct cacheBlock **) a)->block - (*(struct cacheBlock **) b)->block;
+}
 
-    return bytesRead;
+/**
+ * write all dirty cached blocks to disk (in block order)
+ */
+void cacheFlush(struct fs_ctx *fs) {
+    struct cacheBlock **dirty = malloc(fs->cacheSize * sizeof(struct cacheBlock *));
+    int n = 0;
 
+    pthread_mutex_lock(&fs->cacheLock);
+    for (int i = 0; fs->cacheSlots != NULL && i < fs->cacheSize; i++)
+        if (fs->cacheSlots[i].dirty) {
+            if (dirty == NULL)
+                cacheClean(fs, &fs->cacheSlots[i]);
+            else
+                dirty[n++] = &fs->cacheSlots[i];
+        }
+    if (dirty != NULL) {
+        qsort(dirty, n, sizeof(struct cacheBlock *), cacheCmp);
+        for (int i = 0; i < n; i++)
+            cacheClean(fs, dirty[i]);
+        free(dirty);
+    }
+    pthread_mutex_unlock(&fs->cacheLock);
 }
 
-/****************************************************************/
+/**
+ * write disk block b to disk now if it is cached and dirty
+ */
+void cacheFlushBlock(struct fs_ctx *fs, int b) {
+    struct cacheBlock *c;
 
-int fs_write(char *name, char *data, int length, int offset) { // length max value is 8KB, Offset will never be outside the file
+    if (fs->cacheSlots == NULL)
+        return;
+    pthread_mutex_lock(&fs->cacheLock);
+    if ((c = cacheSlot(fs, b)) != NULL)
+        cacheClean(fs, c);
+    pthread_mutex_unlock(&fs->cacheLock);
+}
 
-    if (superB.magic != FS_MAGIC) {
-        printf("disc not mounted\n");
+/**
+ * flush and release the cache (reads/writes then go straight to disk)
+ */
+void cacheFree(struct fs_ctx *fs) {
+    cacheFlush(fs);
+    free(fs->cacheSlots);
+    free(fs->cacheHash);
+    free(fs->cacheData);
+    fs->cacheSlots = NULL;
+    fs->cacheHash = NULL;
+    fs->cacheData = NULL;
+}
+
+/**
+ * allocate cacheSize empty slots
+ * return: 0 if ok, -1 if no memory
+ */
+int cacheInit(struct fs_ctx *fs) {
+    if (fs->cacheSize <= 0)
+        return 0; // no cache
+    for (fs->cacheHashSz = 1; fs->cacheHashSz < fs->cacheSize; fs->cacheHashSz *= 2)
+        ;
+    fs->cacheSlots = malloc(fs->cacheSize * sizeof(struct cacheBlock));
+    fs->cacheHash = calloc(fs->cacheHashSz, sizeof(struct cacheBlock *));
+    fs->cacheData = malloc((size_t) fs->cacheSize * BLOCKSZ);
+    if (fs->cacheSlots == NULL || fs->cacheHash == NULL || fs->cacheData == NULL) {
+        free(fs->cacheSlots);
+        free(fs->cacheHash);
+        free(fs->cacheData);
+        fs->cacheSlots = NULL;
+        fs->cacheHash = NULL;
+        fs->cacheData = NULL;
         return -1;
     }
-    char fname[FNAMESZ];
-    strEncode(fname, name, FNAMESZ);
-
-    // TODO: write data to file
-    int blockNOfFile = offset / BLOCKSZ;                                                                // numero do bloco do ficheiro (como se houvesse um vetor de blocos de ficheiro).
-    int extent = blockNOfFile/FBLOCKS;                                                                  //
-    int blockNumberEntry = blockNOfFile % FBLOCKS;                                                      // numero do bloco da entrada a ser escrita (dirent.blocks[]).
-    int firstBlockOffset = offset % BLOCKSZ;                                                            // o offset do primeiro bloco a ser escrito.
-    int currentBlockOffset = firstBlockOffset;
-    int bytesWritten = 0;
+    fs->cacheLRU.next = fs->cacheLRU.prev = &fs->cacheLRU;
+    for (int i = 0; i < fs->cacheSize; i++) {
+        fs->cacheSlots[i].block = -1;
+        fs->cacheSlots[i].data = fs->cacheData + (size_t) i * BLOCKSZ;
+        fs->cacheSlots[i].dirty = FALSE;
+        fs->cacheSlots[i].prefetched = FALSE;
+        cacheLink(fs, &fs->cacheSlots[i]);
+    }
+    return 0;
+}
+
+/**
+ * write the superblock (with the fsFeatures bits in .magic) to the cache:
+ * superB with dirList, or with FS_F_LARGE a fs_sblock2 with dirIndirect
+ */
+void writeSuper(struct fs_ctx *fs) {
+    union fs_block super;
+
+    memset(super.data, 0, BLOCKSZ);
+    pthread_mutex_lock(&fs->superLock);
+    if (fs->fsFeatures & FS_F_LARGE) {
+        super.super2.blockShift = (uint16_t) fs->blockShift;
+        super.super2.fssize = (uint32_t) fs->fsBlocks;
+        memcpy(super.super2.label, fs->superB.label, LABELSZ);
+        memcpy(super.super2.indirect, fs->dirIndirect, sizeof(fs->dirIndirect));
+    } else {
+        super.super = fs->superB;
+        super.super.fssize = (uint16_t) fs->fsBlocks;
+        for (int i = 0; i < MAXDIRSZ; i++)
+            super.super.dir[i] = (uint16_t) fs->dirList[i];
+    }
+    super.super.magic = FS_MAGIC | fs->fsFeatures | (fs->fsDirty ? FS_F_DIRTY : 0);
+    cacheWrite(fs, SBLOCK, super.data);
+    pthread_mutex_unlock(&fs->superLock);
+}
+
+/**
+ * write entry i of dirList to the cache: with FS_F_LARGE its indirect dir
+ * block, then the superblock (listing the indirect blocks)
+ */
+void dirListWrite(struct fs_ctx *fs, int i) {
+    int j = i / DIRLISTPB;
+
+    pthread_mutex_lock(&fs->superLock);
+    if ((fs->fsFeatures & FS_F_LARGE) && fs->dirIndirect[j] != 0)
+        cacheWrite(fs, fs->dirIndirect[j], (char *) &fs->dirList[j * DIRLISTPB]);
+    pthread_mutex_unlock(&fs->superLock);
+    writeSuper(fs);
+}
+
+/**
+ * set fsDirty (allocLock held, superLock guards it for writeSuper) and
+ * write the superblock
+ */
+void setDirty(struct fs_ctx *fs, int dirty) {
+    pthread_mutex_lock(&fs->superLock);
+    fs->fsDirty = dirty;
+    pthread_mutex_unlock(&fs->superLock);
+    writeSuper(fs);
+}
+
+/**
+ * write blockBitMap to its disk blocks
+ */
+void bitMapWrite(struct fs_ctx *fs) {
+    for (int i = 0; i < BITMAPBLKS(fs->fsBlocks); i++)
+        cacheWrite(fs, 1 + i, (char *) fs->blockBitMap + i * BLOCKSZ);
+}
+
+/**
+ * called before blockBitMap changes (allocLock held): the first change
+ * after the disk is clean marks it dirty, on disk, before any other block
+ * is written
+ */
+void bitMapChanged(struct fs_ctx *fs) {
+    if ((fs->fsFeatures & FS_F_BITMAP) && !fs->fsDirty) {
+        setDirty(fs, TRUE);
+        cacheFlushBlock(fs, SBLOCK);
+    }
+}
+
+/**
+ * flush all cached blocks; with a stored bitmap write it first and then
+ * mark the disk clean (no allocation can run meanwhile)
+ */
+void syncAll(struct fs_ctx *fs) {
+    pthread_mutex_lock(&fs->allocLock);
+    if ((fs->fsFeatures & FS_F_BITMAP) && fs->fsDirty) {
+        bitMapWrite(fs);
+        cacheFlush(fs);
+        if (fs->disk->msync != NULL)
+            fs->disk->msync(fs->disk);
+        setDirty(fs, FALSE);
+    }
+    pthread_mutex_unlock(&fs->allocLock);
+    cacheFlush(fs);
+    if (fs->disk->msync != NULL)
+        fs->disk->msync(fs->disk);
+}
+
+#define BITMAP_TEST(b) ((fs->blockBitMap[(b) / 64] >> ((b) % 64)) & 1)
+#define BITMAP_SET(b) (fs->blockBitMap[(b) / 64] |= (uint64_t) 1 << ((b) % 64))
+#define BITMAP_CLEAR(b) (fs->blockBitMap[(b) / 64] &= ~((uint64_t) 1 << ((b) % 64)))
+
+int blockVecCmp(const void *a, const void *b) {
+    return ((struct blockVec *) a)->block - ((struct blockVec *) b)->block;
+}
+
+/**
+ * read (if write==FALSE) or write the n blocks of vec directly from/to disk,
+ * merging consecutive blocks (vec gets sorted)
+ */
+void blockIOv(struct fs_ctx *fs, struct blockVec *vec, int n, int write) {
+    struct iovec iov[VECMAX * DISKVECMAX];
+    int k = 1 << fs->blockShift; // disk blocks per FS block
+
+    qsort(vec, n, sizeof(struct blockVec), blockVecCmp);
+    for (int i = 0; i < n;) {
+        int run = 1;
+        while (i + run < n && run < VECMAX && vec[i + run].block == vec[i].block + run)
+            run++;
+        if (write ? fs->disk->writev != NULL : fs->disk->readv != NULL) {
+            for (int j = 0; j < run * k; j++) {
+                iov[j].iov_base = vec[i + j / k].buf + j % k * DISK_BLOCK_SIZE;
+                iov[j].iov_len = DISK_BLOCK_SIZE;
+            }
+            if (write)
+                fs->disk->writev(fs->disk, vec[i].block << fs->blockShift, iov, run * k);
+            else
+                fs->disk->readv(fs->disk, vec[i].block << fs->blockShift, iov, run * k);
+            ioDone(fs, write, run * k);
+        } else
+            for (int j = 0; j < run; j++)
+                diskIO(fs, vec[i + j].block, vec[i + j].buf, write);
+        i += run;
+    }
+}
+
+/**
+ * read the n disk blocks not yet cached into cache slots, in one vectored
+ * request (n must be at most half the cache size). The disk is read into
+ * a buffer without cacheLock and the blocks cached after.
+ */
+void cachePrefetch(struct fs_ctx *fs, const uint32_t *blocks, int n) {
+    struct blockVec vec[VECMAX];
+    int nvec = 0;
+
+    if (fs->cacheSlots == NULL)                             // (no cache: nothing to read into)
+        return;
+    char *buf = malloc(MIN(n, VECMAX) * BLOCKSZ);
+    if (buf == NULL)
+        return;
+    pthread_mutex_lock(&fs->cacheLock);
+    for (int i = 0; i < n && nvec < VECMAX; i++)
+        if (blocks[i] != 0 && cacheSlot(fs, blocks[i]) == NULL) {
+            vec[nvec].block = blocks[i];
+            vec[nvec].buf = buf + nvec * BLOCKSZ;
+            nvec++;
+        }
+    pthread_mutex_unlock(&fs->cacheLock);
+    blockIOv(fs, vec, nvec, FALSE);
+    pthread_mutex_lock(&fs->cacheLock);
+    for (int i = 0; i < nvec; i++)
+        if (cacheSlot(fs, vec[i].block) == NULL) {
+            struct cacheBlock *c = cacheNew(fs, vec[i].block);
+            memcpy(c->data, vec[i].buf, BLOCKSZ);
+            c->dirty = FALSE;
+            c->prefetched = TRUE;
+        }
+    pthread_mutex_unlock(&fs->cacheLock);
+    STAT_ADD(fs->cacheStats.prefetched, nvec);
+    free(buf);
+}
+
+/**
+ * read-ahead for file with map m after a read of [offset, end): if reads
+ * are sequential the window doubles (up to raMax), else it is reset.
+ * The next window blocks of the file (crossing into the next extents)
+ * are prefetched when less than half a window is left in the cache.
+ * The read-ahead state is shared by all readers of the file (mapLock).
+ */
+void readAhead(struct fs_ctx *fs, struct extMap *m, int offset, int end, int size) {
+    int max = MIN(fs->raMax, MIN(fs->cacheSize / 2, VECMAX));
+    int from = 0, to = 0;
+
+    pthread_mutex_lock(&fs->mapLock);
+    if (offset != m->nextOffset || max <= 0) {
+        m->raWindow = 0;
+        m->nextOffset = end;
+    } else {
+        m->nextOffset = end;
+        m->raWindow = m->raWindow == 0 ? MIN(RAMIN, max) : MIN(2 * m->raWindow, max);
+
+        int next = (end + BLOCKSZ - 1) / BLOCKSZ;           // first file block not read
+        int last = MIN((size + BLOCKSZ - 1) / BLOCKSZ, m->nExt * FBLOCKS);
+        if (m->raNext - next < m->raWindow / 2) {           // else enough already prefetched
+            from = m->raNext > next ? m->raNext : next;
+            to = MIN(next + m->raWindow, last);
+            if (from < to)
+                m->raNext = to;
+        }
+    }
+    pthread_mutex_unlock(&fs->mapLock);
+    if (from < to)
+        cachePrefetch(fs, &m->blocks[from], to - from);
+}
+
+/**
+ * allocBlock: allocate a new disk block
+ * next-fit: searches from the last allocated block, a 64 block word at a time
+ * return: block number
+ */
+int allocBlock(struct fs_ctx *fs) {
+
+    pthread_mutex_lock(&fs->allocLock);
+    if (fs->freeBlocks == 0) {
+        pthread_mutex_unlock(&fs->allocLock);
+        return -1; // no disk space
+    }
+    bitMapChanged(fs);
+    STAT_ADD(fs->fsStats.allocs, 1);
+    int w = fs->allocCursor / 64;
+    uint64_t avail = ~fs->blockBitMap[w] & (~(uint64_t) 0 << (fs->allocCursor % 64));
+    STAT_ADD(fs->fsStats.allocWords, 1);
+    while (avail == 0) { // skip full words (wrapping around)
+        w = (w + 1) % fs->bitMapWords;
+        avail = ~fs->blockBitMap[w];
+        STAT_ADD(fs->fsStats.allocWords, 1);
+    }
+    int b = w * 64 + __builtin_ctzll(avail);
+    BITMAP_SET(b);
+    fs->freeBlocks--;
+    fs->allocCursor = (b + 1) % fs->fsBlocks;
+    pthread_mutex_unlock(&fs->allocLock);
+    return b;
+}
+
+/**
+ * return: first FREE block in [b, limit), or -1 if none (allocLock held)
+ */
+int nextFreeBlock(struct fs_ctx *fs, int b, int limit) {
+    if (b >= limit)
+        return -1;
+    int w = b / 64;
+    uint64_t avail = ~fs->blockBitMap[w] & (~(uint64_t) 0 << (b % 64));
+    STAT_ADD(fs->fsStats.allocWords, 1);
+    while (avail == 0) {
+        if (++w * 64 >= limit)
+            return -1;
+        avail = ~fs->blockBitMap[w];
+        STAT_ADD(fs->fsStats.allocWords, 1);
+    }
+    b = w * 64 + __builtin_ctzll(avail);
+    return b < limit ? b : -1;
+}
+
+/**
+ * allocRun: allocate up to n contiguous disk blocks, starting at block goal
+ * if it is free, else at the first run of n FREE blocks after the next-fit
+ * cursor, else at the longest run found
+ * return: first block number and in *count the run length (-1 if disk full)
+ */
+int allocRun(struct fs_ctx *fs, int goal, int n, int *count) {
+    int start = -1, len = 0;
+
+    if (n <= 0)
+        return -1;
+    pthread_mutex_lock(&fs->allocLock);
+    if (fs->freeBlocks == 0) {
+        pthread_mutex_unlock(&fs->allocLock);
+        return -1; // no disk space
+    }
+    bitMapChanged(fs);
+    STAT_ADD(fs->fsStats.allocs, 1);
+    if (goal > 0 && goal < fs->fsBlocks && !BITMAP_TEST(goal)) {
+        start = goal;
+        while (len < n && goal + len < fs->fsBlocks && !BITMAP_TEST(goal + len))
+            len++;
+    }
+    int from[2] = {fs->allocCursor, 0}, to[2] = {fs->fsBlocks, fs->allocCursor};
+    for (int pass = 0; pass < 2 && len < n; pass++)
+        for (int b = nextFreeBlock(fs, from[pass], to[pass]); b != -1 && len < n;
+             b = nextFreeBlock(fs, b, to[pass])) {
+            int r = 0;
+            while (r < n && b + r < to[pass] && !BITMAP_TEST(b + r))
+                r++;
+            if (r > len) {
+                start = b;
+                len = r;
+            }
+            b += r;
+        }
+    for (int i = 0; i < len; i++)
+        BITMAP_SET(start + i);
+    fs->freeBlocks -= len;
+    fs->allocCursor = (start + len) % fs->fsBlocks;
+    pthread_mutex_unlock(&fs->allocLock);
+    *count = len;
+    return start;
+}
+
+/**
+ * return: TRUE if disk block b is shared with other files (clones), so it
+ * must be copied to be written. A file's lock holder may see it shared
+ * while the other files drop it (then it is copied for nothing), but never
+ * see it not shared while it is: only cloning the file adds references.
+ */
+int blockShared(struct fs_ctx *fs, int b) {
+    uint32_t *refs = __atomic_load_n(&fs->blockRefs, __ATOMIC_ACQUIRE);
+    return refs != NULL && __atomic_load_n(&refs[b], __ATOMIC_RELAXED) > 0;
+}
+
+/**
+ * allocate blockRefs (all zero) if not yet (allocLock held, or mounting)
+ * return: 0 if ok, -1 if no memory
+ */
+int blockRefsAlloc(struct fs_ctx *fs) {
+    if (fs->blockRefs == NULL) {
+        uint32_t *refs = calloc(fs->fsBlocks, sizeof(uint32_t));
+        if (refs == NULL)
+            return -1;
+        __atomic_store_n(&fs->blockRefs, refs, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/**
+ * free disk block nblock, or if it is shared drop one of its references
+ */
+void freeBlock(struct fs_ctx *fs, int nblock) {
+    pthread_mutex_lock(&fs->allocLock);
+    if (fs->blockRefs != NULL && fs->blockRefs[nblock] > 0)
+        __atomic_fetch_sub(&fs->blockRefs[nblock], 1, __ATOMIC_RELAXED);
+    else if (BITMAP_TEST(nblock)) {
+        bitMapChanged(fs);
+        BITMAP_CLEAR(nblock);
+        fs->freeBlocks++;
+    }
+    pthread_mutex_unlock(&fs->allocLock);
+}
+
+/**
+ * free the n blocks in 'blocks' (zeros are skipped, shared ones lose a
+ * reference), with one allocLock
+ */
+void freeBlockList(struct fs_ctx *fs, const uint32_t *blocks, int n) {
+    pthread_mutex_lock(&fs->allocLock);
+    for (int i = 0; i < n; i++)
+        if (blocks[i] != 0 && fs->blockRefs != NULL && fs->blockRefs[blocks[i]] > 0)
+            __atomic_fetch_sub(&fs->blockRefs[blocks[i]], 1, __ATOMIC_RELAXED);
+        else if (blocks[i] != 0 && BITMAP_TEST(blocks[i])) {
+            bitMapChanged(fs);
+            BITMAP_CLEAR(blocks[i]);
+            fs->freeBlocks++;
+        }
+    pthread_mutex_unlock(&fs->allocLock);
+}
+
+/**
+ * copy str to dst, converting from C string to FS string:
+ *   - uppercase letters and ending with spaces
+ * dst and str must exist with at least len chars
+ */
+void strEncode(char *dst, char *str, int len) {
+    int i;
+    for (i = 0; i < len && str[i] != '\0'; i++)
+        if (isalpha(str[i]))
+            dst[i] = toupper(str[i]);
+        else if (isdigit(str[i]) || str[i] == '_' || str[i] == '.')
+            dst[i] = str[i];
+        else
+            dst[i] = '?'; // invalid char?
+    for (; i < len; i++)
+        dst[i] = ' '; // fill with space
+
+}
+
+/**
+ * copy str to dst, converting from FS string to C string
+ * dst must exist with at least len+1 chars
+ */
+void strDecode(char *dst, const char *str, int len) {
+    int i;
+    for (i = len - 1; i > 0 && str[i] == ' '; i--)
+        ;
+    dst[i + 1] = '\0';
+    for (; i >= 0; i--)
+        dst[i] = str[i];
+}
+
+/**
+ * print super block content to stdout (for debug)
+ */
+void dumpSB(struct fs_ctx *fs) {
+    union fs_block block;
+    char label[LABELSZ + 1];
+
+    cacheRead(fs, SBLOCK, block.data);
+    int large = block.super.magic & FS_F_LARGE;
+    int bsize = large ? DISK_BLOCK_SIZE << block.super2.blockShift : DISK_BLOCK_SIZE;
+    int fssize = large ? (int) block.super2.fssize : block.super.fssize;
+    printf("superblock:\n");
+    printf("    magic = %x\n", block.super.magic);
+    if (block.super.magic & FS_F_BITMAP)
+        printf("    bitmap blocks: 1..%d (%s)\n", (fssize + bsize * 8 - 1) / (bsize * 8),
+               block.super.magic & FS_F_DIRTY ? "dirty" : "clean");
+    if (block.super.magic & FS_F_SIZE32)
+        printf("    32 bit file sizes\n");
+    if (block.super.magic & FS_F_EXT32)
+        printf("    32 bit extent ids\n");
+    if (large)
+        printf("    32 bit block numbers, %d byte blocks\n", bsize);
+    printf("    %d blocks\n", fssize);
+    if (!large) {
+        printf("    dir_size: %d\n", MAXDIRSZ);
+        printf("    first dir block: %d\n", block.super.dir[0]);
+    }
+    strDecode(label, large ? block.super2.label : block.super.label, LABELSZ);
+    printf("    disk label: %s\n", label);
+
+    printf(large ? "indirect dir blocks: " : "dir blocks: ");
+    for (int i = 0; large ? i < SB2INDIRECT && block.super2.indirect[i] != 0 :
+                            i < MAXDIRSZ && block.super.dir[i] != 0; i++)
+        printf("%u ", large ? block.super2.indirect[i] : block.super.dir[i]);
+    putchar('\n');
+}
+
+/**
+ * hash of a (FS encoded name, extent id) key; extent 0 is the TFILE dirent
+ */
+unsigned int dirHash(const char *name, uint32_t ext) {
+    unsigned int h = 2166136261u; // FNV-1a
+    for (int i = 0; i < FNAMESZ; i++)
+        h = (h ^ (uint8_t) name[i]) * 16777619u;
+    for (int i = 0; i < 32; i += 8)
+        h = (h ^ ((ext >> i) & 0xff)) * 16777619u;
+    return h;
+}
+
+/**
+ * add/remove dirent idx (from dirCache) to/from the hash index.
+ * Only file dirents and extents are indexed.
+ */
+void dirIndexAdd(struct fs_ctx *fs, int idx) {
+    struct fs_dirent *d = &fs->dirCache[idx];
+    if (!ISFILE(d) && !ISEXT(d))
+        return;
+    unsigned int h = dirHash(d->name, ISEXT(d) ? EXTID(d) : 0) & (fs->dirHashSz - 1);
+    fs->dirHashNext[idx] = fs->dirHashHead[h];
+    fs->dirHashHead[h] = idx;
+}
+
+void dirIndexRemove(struct fs_ctx *fs, int idx) {
+    struct fs_dirent *d = &fs->dirCache[idx];
+    if (!ISFILE(d) && !ISEXT(d))
+        return;
+    int *p = &fs->dirHashHead[dirHash(d->name, ISEXT(d) ? EXTID(d) : 0) & (fs->dirHashSz - 1)];
+    while (*p != -1 && *p != idx)
+        p = &fs->dirHashNext[*p];
+    if (*p == idx)
+        *p = fs->dirHashNext[idx];
+}
+
+/**
+ * grow dirCache to nblocks directory blocks (new dirents are empty).
+ * The first call allocates room for maxDirBlocks blocks, so it never moves
+ * (untouched memory is not used), and the hash chains (empty).
+ * return: 0 if ok, -1 if out of memory
+ */
+int dirCacheGrow(struct fs_ctx *fs, int nblocks) {
+    if (fs->dirCache == NULL) {
+        size_t n = (size_t) fs->maxDirBlocks * DIRENTS_PER_BLOCK;
+        for (fs->dirHashSz = DIRHASHSZ; (size_t) fs->dirHashSz < n / 4; fs->dirHashSz *= 2)
+            ;
+        fs->dirCache = calloc(n, sizeof(struct fs_dirent));
+        fs->dirHashNext = malloc(n * sizeof(int));
+        fs->dirHashHead = malloc(fs->dirHashSz * sizeof(int));
+        if (fs->dirCache == NULL || fs->dirHashNext == NULL || fs->dirHashHead == NULL) {
+            free(fs->dirCache);
+            free(fs->dirHashNext);
+            free(fs->dirHashHead);
+            fs->dirCache = NULL;
+            fs->dirHashNext = NULL;
+            fs->dirHashHead = NULL;
+            return -1;
+        }
+        for (int h = 0; h < fs->dirHashSz; h++)
+            fs->dirHashHead[h] = -1;
+    }
+    fs->dirBlocks = nblocks;
+    return 0;
+}
+
+/**
+ * copy dir block i of dirCache to/from buf in its disk format: 16 bit
+ * dirents, or with FS_F_LARGE the dirents as in memory (zeros after them)
+ */
+void dirBlockEncode(struct fs_ctx *fs, int i, char *buf) {
+    struct fs_dirent *d = &fs->dirCache[i * DIRENTS_PER_BLOCK];
+
+    if (fs->fsFeatures & FS_F_LARGE) {
+        memcpy(buf, d, DIRENTS_PER_BLOCK * sizeof(struct fs_dirent));
+        memset(buf + DIRENTS_PER_BLOCK * sizeof(struct fs_dirent), 0,
+               BLOCKSZ - DIRENTS_PER_BLOCK * sizeof(struct fs_dirent));
+        return;
+    }
+    for (int j = 0; j < DIRENTS_PER_BLOCK; j++) {
+        struct fs_dirent16 *d16 = (struct fs_dirent16 *) buf + j;
+        memcpy(d16->head, &d[j], sizeof(d16->head));
+        if (d[j].st == TINLINE)
+            memcpy(d16->blocks, d[j].blocks, INLINESZ);
+        else
+            for (int k = 0; k < FBLOCKS; k++)
+                d16->blocks[k] = (uint16_t) d[j].blocks[k];
+    }
+}
+
+void dirBlockDecode(struct fs_ctx *fs, int i, const char *buf) {
+    struct fs_dirent *d = &fs->dirCache[i * DIRENTS_PER_BLOCK];
+
+    if (fs->fsFeatures & FS_F_LARGE) {
+        memcpy(d, buf, DIRENTS_PER_BLOCK * sizeof(struct fs_dirent));
+        return;
+    }
+    for (int j = 0; j < DIRENTS_PER_BLOCK; j++) {
+        const struct fs_dirent16 *d16 = (const struct fs_dirent16 *) buf + j;
+        memcpy(&d[j], d16->head, sizeof(d16->head));
+        memset(d[j].blocks, 0, sizeof(d[j].blocks));
+        if (d[j].st == TINLINE)
+            memcpy(d[j].blocks, d16->blocks, INLINESZ);
+        else
+            for (int k = 0; k < FBLOCKS; k++)
+                d[j].blocks[k] = d16->blocks[k];
+    }
+}
+
+/**
+ * write dir block number i (of dirList) from dirCache to disk
+ */
+void dirBlockWrite(struct fs_ctx *fs, int i) {
+    union fs_block block;
+
+    dirBlockEncode(fs, i, block.data);
+    cacheWrite(fs, fs->dirList[i], block.data);
+}
+
+/**
+ * return: dirent index of extent ext of file name (see readFileEntry), or
+ * -1 if not found (dirLock held)
+ */
+int dirLookup(struct fs_ctx *fs, const char *name, uint32_t ext) {
+    STAT_ADD(fs->fsStats.lookups, 1);
+    for (int i = fs->dirHashHead[dirHash(name, ext) & (fs->dirHashSz - 1)]; i != -1;
+         i = fs->dirHashNext[i]) {
+        STAT_ADD(fs->fsStats.lookupProbes, 1);
+        if (((ext == 0 && ISFILE(&fs->dirCache[i])) ||
+             (ISEXT(&fs->dirCache[i]) && EXTID(&fs->dirCache[i]) == ext)) &&
+            strncmp(fs->dirCache[i].name, name, FNAMESZ) == 0)
+            return i; // this dirent index
+    }
+    return -1;
+}
+
+/**
+ * search and read file dirent/extent:
+ * 	if ext==0: find 1st entry (with .st=TFILE, TINLINE or TZFILE)
+ * 	if ext>0:  find extent (with .st=TEXT or TZEXT) and EXTID==ext
+ *  if ent!=NULL fill it with a copy of the dirent/extent
+ *  return dirent index in the directory (or -1 if not found)
+ */
+int readFileEntry(struct fs_ctx *fs, char *name, uint32_t ext, struct fs_dirent *ent) {
+    pthread_rwlock_rdlock(&fs->dirLock);
+    int found = dirLookup(fs, name, ext);
+    if (found != -1 && ent != NULL)
+        *ent = fs->dirCache[found];
+    pthread_rwlock_unlock(&fs->dirLock);
+    return found;
+}
+
+/**
+ * return: size in bytes of the file with first dirent 'first'
+ */
+int fileSize(struct fs_ctx *fs, struct fs_dirent *first) {
+    if ((fs->fsFeatures & FS_F_SIZE32) || first->st == TINLINE)
+        return (int) first->size;
+    return first->ex * FBLOCKS * BLOCKSZ + first->ss;
+}
+
+/**
+ * return: number of extents of the file with first dirent 'first'
+ */
+int fileExtents(struct fs_ctx *fs, struct fs_dirent *first) {
+    if (fs->fsFeatures & FS_F_SIZE32)
+        return first->size > 0 ? (first->size - 1) / (FBLOCKS * BLOCKSZ) + 1 : 1;
+    return first->ex + 1;
+}
+
+/**
+ * return: largest file size in bytes (without FS_F_EXT32 extent ids, and
+ * without FS_F_SIZE32 the number of extra extents, .ex of the TFILE
+ * dirent, are 16 bit)
+ */
+int maxFileSize(struct fs_ctx *fs) {
+    if (fs->fsFeatures & FS_F_EXT32)
+        return INT_MAX;
+    return (int) MIN((long long) (UINT16_MAX + 1) * EXTSZ, INT_MAX);
+}
+
+/**
+ * return: cached extent map of fname, or NULL if not cached (mapLock held)
+ */
+struct extMap *extMapFind(struct fs_ctx *fs, const char *fname) {
+    for (int i = 0; i < NEXTMAPS; i++)
+        if (fs->extMaps[i].used && strncmp(fs->extMaps[i].name, fname, FNAMESZ) == 0)
+            return &fs->extMaps[i];
+    return NULL;
+}
+
+/**
+ * drop the cached extent map of fname (if any) (mapLock held)
+ */
+void extMapDrop(struct fs_ctx *fs, const char *fname) {
+    struct extMap *m = extMapFind(fs, fname);
+    if (m != NULL)
+        m->used = 0;
+}
+
+/**
+ * set the number of extents of map m; new extents are empty
+ * return: 0 if ok, -1 if out of memory
+ */
+int extMapResize(struct extMap *m, int nExt) {
+    int *dirIdx = realloc(m->dirIdx, nExt * sizeof(int));
+    if (dirIdx == NULL)
+        return -1;
+    m->dirIdx = dirIdx;
+    uint32_t *blocks = realloc(m->blocks, nExt * FBLOCKS * sizeof(uint32_t));
+    if (blocks == NULL)
+        return -1;
+    m->blocks = blocks;
+    uint16_t *zLen = realloc(m->zLen, nExt * sizeof(uint16_t));
+    if (zLen == NULL)
+        return -1;
+    m->zLen = zLen;
+    for (int e = m->nExt; e < nExt; e++) {
+        m->dirIdx[e] = -1;
+        memset(&m->blocks[e * FBLOCKS], 0, FBLOCKS * sizeof(uint32_t));
+        m->zLen[e] = 0;
+    }
+    m->nExt = nExt;
+    return 0;
+}
+
+/**
+ * set extent ext of map m from its dirent 'entry': its block numbers (none
+ * for a tiny file, whose .blocks hold data) and compressed length
+ */
+void extMapSet(struct extMap *m, int ext, const struct fs_dirent *entry) {
+    memset(&m->blocks[ext * FBLOCKS], 0, sizeof(entry->blocks));
+    memcpy(&m->blocks[ext * FBLOCKS], entry->blocks, BLOCKPTRS(entry) * sizeof(uint32_t));
+    m->zLen[ext] = ISZIP(entry) ? ZLEN(entry) : 0;
+}
+
+/**
+ * get the extent map of file fname (FS encoded), building it from the
+ * directory if not cached (evicting the least recently used map). The
+ * caller holds the file lock and the map is pinned until extMapPut.
+ * return: the map, or NULL if the file does not exist (or no memory)
+ */
+struct extMap *extMapGet(struct fs_ctx *fs, char *fname) {
+    pthread_mutex_lock(&fs->mapLock);
+    struct extMap *m = extMapFind(fs, fname);
+    if (m != NULL) {
+        m->used = ++fs->extMapClock;
+        m->refs++;
+        pthread_mutex_unlock(&fs->mapLock);
+        return m;
+    }
+    pthread_mutex_unlock(&fs->mapLock);
+
+    // build it without mapLock: with the file lock held its dirents can't change
+    struct extMap new;
+    struct fs_dirent ent;
+    int idx = readFileEntry(fs, fname, 0, &ent);
+    if (idx == -1)
+        return NULL;
+    memset(&new, 0, sizeof(new));
+    if (extMapResize(&new, fileExtents(fs, &ent)) == -1) {
+        free(new.dirIdx);
+        free(new.blocks);
+        free(new.zLen);
+        return NULL;
+    }
+    memcpy(new.name, fname, FNAMESZ);
+    for (int e = 0; e < new.nExt; e++) {
+        if (e > 0 && (idx = readFileEntry(fs, fname, (uint32_t) e, &ent)) == -1)
+            continue;
+        new.dirIdx[e] = idx;
+        extMapSet(&new, e, &ent);
+    }
+
+    pthread_mutex_lock(&fs->mapLock);
+    while ((m = extMapFind(fs, fname)) == NULL) {           // else built by another reader
+        for (int i = 0; i < NEXTMAPS; i++)
+            if (fs->extMaps[i].refs == 0 && (m == NULL || fs->extMaps[i].used < m->used))
+                m = &fs->extMaps[i];
+        if (m != NULL)
+            break;
+        pthread_cond_wait(&fs->mapFree, &fs->mapLock);      // all pinned
+    }
+    if (m->used == 0 || strncmp(m->name, fname, FNAMESZ) != 0) {
+        free(m->dirIdx);
+        free(m->blocks);
+        free(m->zLen);
+        *m = new;
+    } else {
+        free(new.dirIdx);
+        free(new.blocks);
+        free(new.zLen);
+    }
+    m->used = ++fs->extMapClock;
+    m->refs++;
+    pthread_mutex_unlock(&fs->mapLock);
+    return m;
+}
+
+/**
+ * unpin map m (got from extMapGet), NULL is ignored
+ */
+void extMapPut(struct fs_ctx *fs, struct extMap *m) {
+    if (m == NULL)
+        return;
+    pthread_mutex_lock(&fs->mapLock);
+    if (--m->refs == 0)
+        pthread_cond_broadcast(&fs->mapFree);
+    pthread_mutex_unlock(&fs->mapLock);
+}
+
+/**
+ * keep cached extent maps in sync when dirent idx changes from old to
+ * 'entry' (mapLock held). Removing a file's first dirent drops its map,
+ * removing an extent (truncate) only empties it in the map.
+ */
+void extMapUpdate(struct fs_ctx *fs, int idx, struct fs_dirent *old, struct fs_dirent *entry) {
+    if ((ISFILE(old) || ISEXT(old)) &&
+        (entry->st == TEMPTY || strncmp(old->name, entry->name, FNAMESZ) != 0)) {
+        struct extMap *m = extMapFind(fs, old->name);
+        if (m != NULL && ISEXT(old) && EXTID(old) < (uint32_t) m->nExt) {
+            m->dirIdx[EXTID(old)] = -1;
+            memset(&m->blocks[EXTID(old) * FBLOCKS], 0, sizeof(old->blocks));
+            m->zLen[EXTID(old)] = 0;
+        } else if (m != NULL)
+            m->used = 0;
+    }
+    if (!ISFILE(entry) && !ISEXT(entry))
+        return;
+
+    struct extMap *m = extMapFind(fs, entry->name);
+    if (m == NULL)
+        return;
+    int ext = ISEXT(entry) ? (int) EXTID(entry) : 0;
+    if ((ISFILE(entry) && fileExtents(fs, entry) > m->nExt &&
+         extMapResize(m, fileExtents(fs, entry)) == -1) ||
+        (ext >= m->nExt && extMapResize(m, ext + 1) == -1)) {
+        m->used = 0;
+        return;
+    }
+    m->dirIdx[ext] = idx;
+    extMapSet(m, ext, entry);
+}
+
+/**
+ * return: the lock (stripe) of file fname (FS encoded)
+ */
+pthread_rwlock_t *fileLock(struct fs_ctx *fs, const char *fname) {
+    return &fs->fileLocks[dirHash(fname, 0) & (FILELOCKS - 1)];
+}
+
+/**
+ * update dirent at idx with 'entry' or, if idx==-1, add a new dirent to
+ * directory with 'entry' content.
+ * return: idx used/allocated, -1 if error (no space in directory)
+ */
+int writeFileEntry(struct fs_ctx *fs, int idx, struct fs_dirent entry) {
+
+    // update dirent idx or allocate a new one
+    // and write to directory on disk
+
+    // notice: directory may need to grow!!
+    struct fs_dirent old;
+    pthread_rwlock_wrlock(&fs->dirLock);
+    if(idx == -1) {
+        while(fs->dirFree < fs->dirBlocks * DIRENTS_PER_BLOCK &&
+              fs->dirCache[fs->dirFree].st != TEMPTY)
+            fs->dirFree++;
+        if(fs->dirFree < fs->dirBlocks * DIRENTS_PER_BLOCK)
+            idx = fs->dirFree;
+    }
+    if(idx == -1) {
+        int i = fs->dirBlocks, blockNumber = -1, list = 0; // new dir block i
+        if(i == fs->maxDirBlocks || (blockNumber = allocBlock(fs)) == -1 ||
+           ((fs->fsFeatures & FS_F_LARGE) && fs->dirIndirect[i / DIRLISTPB] == 0 &&
+            (list = allocBlock(fs)) == -1) ||             // (and a block to list it)
+           dirCacheGrow(fs, i + 1) == -1) {
+            if(blockNumber != -1)
+                freeBlock(fs, blockNumber);
+            if(list > 0)
+                freeBlock(fs, list);
+            pthread_rwlock_unlock(&fs->dirLock);
+            return -1; // directory is full (or no disk space)
+        }
+        pthread_mutex_lock(&fs->superLock);
+        fs->dirList[i] = (uint32_t) blockNumber;
+        if(list > 0)
+            fs->dirIndirect[i / DIRLISTPB] = (uint32_t) list;
+        pthread_mutex_unlock(&fs->superLock);
+        dirListWrite(fs, i);
+        idx = i * DIRENTS_PER_BLOCK;
+    } else
+        dirIndexRemove(fs, idx);
+
+    old = fs->dirCache[idx];
+    fs->dirCache[idx] = entry;
+    dirIndexAdd(fs, idx);
+    if(entry.st == TEMPTY)
+        fs->dirFree = MIN(fs->dirFree, idx);
+    else if(idx == fs->dirFree)
+        fs->dirFree = idx + 1;
+    dirBlockWrite(fs, idx / DIRENTS_PER_BLOCK);
+    pthread_rwlock_unlock(&fs->dirLock);
+
+    pthread_mutex_lock(&fs->mapLock);
+    extMapUpdate(fs, idx, &old, &entry);
+    pthread_mutex_unlock(&fs->mapLock);
+    return idx;
+}
+
+/**
+ * clear the n dirents idx[0..n-1] (of files whose locks are held) in one
+ * directory update: each touched dir block is written once
+ */
+void dirRemove(struct fs_ctx *fs, const int *idx, int n) {
+    struct fs_dirent empty;
+
+    memset(&empty, 0, sizeof(empty));
+    pthread_rwlock_wrlock(&fs->dirLock);
+    char *touched = calloc(fs->dirBlocks, 1);               // (if NULL: all written)
+    pthread_mutex_lock(&fs->mapLock);
+    for (int i = 0; i < n; i++) {
+        struct fs_dirent old = fs->dirCache[idx[i]];
+        dirIndexRemove(fs, idx[i]);
+        fs->dirCache[idx[i]] = empty;
+        fs->dirFree = MIN(fs->dirFree, idx[i]);
+        if (touched != NULL)
+            touched[idx[i] / DIRENTS_PER_BLOCK] = TRUE;
+        extMapUpdate(fs, idx[i], &old, &empty);
+    }
+    pthread_mutex_unlock(&fs->mapLock);
+    for (int b = 0; b < fs->dirBlocks; b++)
+        if (touched == NULL || touched[b])
+            dirBlockWrite(fs, b);
+    free(touched);
+    pthread_rwlock_unlock(&fs->dirLock);
+}
+
+/****************************************************************/
+
+struct fs_ctx *ctxList; // all contexts (linked by .nextCtx)
+pthread_mutex_t ctxListLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * flush the cache of all mounted contexts, even if never unmounted
+ */
+void fsAtExit() {
+    pthread_mutex_lock(&ctxListLock);
+    for (struct fs_ctx *fs = ctxList; fs != NULL; fs = fs->nextCtx)
+        if (fs->superB.magic == FS_MAGIC)
+            syncAll(fs);
+    pthread_mutex_unlock(&ctxListLock);
+}
+
+/**
+ * create a filesystem context (not mounted) for the disk handle disk
+ * return: the context, or NULL if no memory
+ */
+struct fs_ctx *fs_ctx_new(struct fs_disk *disk) {
+    struct fs_ctx *fs = calloc(1, sizeof(struct fs_ctx));
+
+    if (fs == NULL)
+        return NULL;
+    fs->disk = disk;
+    for (int i = 0; i < FILELOCKS; i++)
+        pthread_rwlock_init(&fs->fileLocks[i], NULL);
+    pthread_rwlock_init(&fs->dirLock, NULL);
+    pthread_mutex_init(&fs->allocLock, NULL);
+    pthread_mutex_init(&fs->superLock, NULL);
+    pthread_mutex_init(&fs->cacheLock, NULL);
+    pthread_mutex_init(&fs->mapLock, NULL);
+    pthread_cond_init(&fs->mapFree, NULL);
+    pthread_mutex_init(&fs->aioLock, NULL);
+    pthread_cond_init(&fs->aioWork, NULL);
+    pthread_cond_init(&fs->aioDone, NULL);
+    pthread_mutex_init(&fs->traceLock, NULL);
+    fs->cacheSize = CACHESZ;
+    fs->cacheWriteThrough = FALSE;
+    fs->raMax = RAMAX;
+    fs->blockSize = DISK_BLOCK_SIZE;
+
+    pthread_mutex_lock(&ctxListLock);
+    if (ctxList == NULL)
+        atexit(fsAtExit); // first context
+    fs->nextCtx = ctxList;
+    ctxList = fs;
+    pthread_mutex_unlock(&ctxListLock);
+    return fs;
+}
+
+struct fs_ctx *defaultFs; // context of the fs.h API
+pthread_once_t defaultOnce = PTHREAD_ONCE_INIT;
+
+void defaultInit() {
+    stdDisk = (struct fs_disk) {
+        stdSize, stdRead, stdWrite,
+        disk_readv != NULL ? stdReadv : NULL, disk_writev != NULL ? stdWritev : NULL,
+        disk_borrow != NULL ? stdBorrow : NULL, disk_msync != NULL ? stdMsync : NULL, NULL,
+    };
+    if ((defaultFs = fs_ctx_new(&stdDisk)) == NULL) {
+        printf("no memory for the filesystem\n");
+        exit(1);
+    }
+}
+
+/**
+ * return: the default context, on the disk.h device (created on first use)
+ */
+struct fs_ctx *defaultCtx() {
+    pthread_once(&defaultOnce, defaultInit);
+    return defaultFs;
+}
+
+/****************************************************************/
+
+/**
+ * queue lane l for a worker (aioLock held)
+ */
+void aioLaneReady(struct fs_ctx *fs, struct aioLane *l) {
+    l->nextReady = NULL;
+    if (fs->aioReadyTail != NULL)
+        fs->aioReadyTail->nextReady = l;
+    else
+        fs->aioReady = l;
+    fs->aioReadyTail = l;
+    pthread_cond_signal(&fs->aioWork);
+}
+
+/**
+ * worker thread: runs the head request of ready lanes, one lane at a time
+ */
+void *aioWorker(void *arg) {
+    struct fs_ctx *fs = arg;
+
+    aioWorkerOf = fs;
+    pthread_mutex_lock(&fs->aioLock);
+    while (1) {
+        while (fs->aioReady == NULL && !fs->aioStop)
+            pthread_cond_wait(&fs->aioWork, &fs->aioLock);
+        if (fs->aioReady == NULL)
+            break;
+        struct aioLane *l = fs->aioReady;
+        if ((fs->aioReady = l->nextReady) == NULL)
+            fs->aioReadyTail = NULL;
+        l->busy = TRUE;
+        struct aioReq *r = l->head;
+        pthread_mutex_unlock(&fs->aioLock);
+
+        int result = r->write ? fs_ctx_write(fs, r->name, r->data, r->length, r->offset)
+                              : fs_ctx_read(fs, r->name, r->data, r->length, r->offset);
+
+        pthread_mutex_lock(&fs->aioLock);
+        if ((l->head = r->next) == NULL)
+            l->tail = NULL;
+        l->busy = FALSE;
+        if (l->head != NULL)
+            aioLaneReady(fs, l);
+        r->result = result;
+        r->done = TRUE;
+        fs->aioPending--;
+        if (r->cb != NULL) {
+            fs->aioCallbacks++;
+            pthread_mutex_unlock(&fs->aioLock);
+            r->cb(r->id, result, r->arg);
+            pthread_mutex_lock(&fs->aioLock);
+            fs->aioCallbacks--;
+            r->id = 0; // free slot
+        }
+        pthread_cond_broadcast(&fs->aioDone);
+    }
+    pthread_mutex_unlock(&fs->aioLock);
+    return NULL;
+}
+
+/**
+ * queue a fs_read (write==FALSE) or fs_write of file name, starting the
+ * workers if needed. If all AIOMAX slots are taken it waits for one while
+ * some request is still running (it frees a slot if it has a callback,
+ * else may be reaped by another thread); not if all are done and wait to
+ * be reaped, or in a worker of fs (its callback would wait on itself).
+ * return: request id (> 0), or -1 if error (errno EAGAIN: no free slot)
+ */
+int aioSubmit(struct fs_ctx *fs, int write, char *name, char *data, int length, int offset,
+              fs_aio_callback cb, void *arg) {
+    struct aioReq *r = NULL;
+
+    if (fs->superB.magic != FS_MAGIC) {
+        printf("disc not mounted\n");
+        return -1;
+    }
+    pthread_mutex_lock(&fs->aioLock);
+    while (fs->aioNWorkers < AIOWORKERS &&
+           pthread_create(&fs->aioWorkers[fs->aioNWorkers], NULL, aioWorker, fs) == 0)
+        fs->aioNWorkers++;
+    if (fs->aioNWorkers == 0) {
+        pthread_mutex_unlock(&fs->aioLock);
+        return -1; // no threads
+    }
+    while (r == NULL) {
+        for (int i = 0; i < AIOMAX && r == NULL; i++) // next slots in id order
+            if (fs->aioReqs[(fs->aioSeq + 1 + i) % AIOMAX].id == 0) {
+                fs->aioSeq += 1 + i;
+                r = &fs->aioReqs[fs->aioSeq % AIOMAX];
+            }
+        if (r != NULL)
+            break;
+        if (aioWorkerOf == fs || fs->aioPending + fs->aioCallbacks == 0) {
+            pthread_mutex_unlock(&fs->aioLock);
+            errno = EAGAIN;
+            return -1;
+        }
+        pthread_cond_wait(&fs->aioDone, &fs->aioLock);
+    }
+    if (fs->aioSeq <= 0 || fs->aioSeq > INT_MAX - AIOMAX) // keep ids positive
+        fs->aioSeq = AIOMAX + (int) (r - fs->aioReqs);
+    r->id = fs->aioSeq;
+    r->write = write;
+    strncpy(r->name, name, FNAMESZ);
+    r->name[FNAMESZ] = '\0';
+    r->data = data;
+    r->length = length;
+    r->offset = offset;
+    r->cb = cb;
+    r->arg = arg;
+    r->done = FALSE;
+    r->next = NULL;
+
+    char fname[FNAMESZ];
+    strEncode(fname, name, FNAMESZ);
+    struct aioLane *l = &fs->aioLanes[dirHash(fname, 0) & (AIOLANES - 1)];
+    if (l->tail != NULL)
+        l->tail->next = r;
+    else
+        l->head = r;
+    l->tail = r;
+    if (l->head == r && !l->busy)
+        aioLaneReady(fs, l);
+    fs->aioPending++;
+    int id = r->id;
+    pthread_mutex_unlock(&fs->aioLock);
+    return id;
+}
+
+/**
+ * get the result of request id, waiting for it to complete if wait is TRUE;
+ * a completed request is released (its id is no longer valid)
+ * return: 1 if done (result in *result), 0 if not done, -1 if id is not
+ * valid (or it has a callback)
+ */
+int aioReap(struct fs_ctx *fs, int id, int *result, int wait) {
+    struct aioReq *r = &fs->aioReqs[(id > 0 ? id : 0) % AIOMAX];
+    int done = -1;
+
+    pthread_mutex_lock(&fs->aioLock);
+    while (id > 0 && r->id == id && r->cb == NULL) {
+        if (r->done) {
+            if (result != NULL)
+                *result = r->result;
+            r->id = 0;
+            pthread_cond_broadcast(&fs->aioDone); // a free slot
+            done = 1;
+            break;
+        }
+        if (!wait) {
+            done = 0;
+            break;
+        }
+        pthread_cond_wait(&fs->aioDone, &fs->aioLock);
+    }
+    pthread_mutex_unlock(&fs->aioLock);
+    return done;
+}
+
+/**
+ * wait until all submitted requests are done
+ */
+void aioDrain(struct fs_ctx *fs) {
+    pthread_mutex_lock(&fs->aioLock);
+    while (fs->aioPending > 0)
+        pthread_cond_wait(&fs->aioDone, &fs->aioLock);
+    pthread_mutex_unlock(&fs->aioLock);
+}
+
+/**
+ * run the requests still queued and stop the workers
+ */
+void aioShutdown(struct fs_ctx *fs) {
+    pthread_mutex_lock(&fs->aioLock);
+    fs->aioStop = TRUE;
+    pthread_cond_broadcast(&fs->aioWork);
+    pthread_mutex_unlock(&fs->aioLock);
+    for (int i = 0; i < fs->aioNWorkers; i++)
+        pthread_join(fs->aioWorkers[i], NULL);
+    fs->aioNWorkers = 0;
+}
+
+/****************************************************************/
+
+/* dirents and data blocks of the files deleted by one call */
+struct delBatch {
+    int *idx;          // dirents to clear
+    int nIdx, maxIdx;
+    uint32_t *blocks;  // data blocks to free
+    int nBlocks, maxBlocks;
+};
+
+/**
+ * add the dirents and blocks of file fname (FS encoded, its lock held) to
+ * batch b, from its extent map (no directory scan)
+ * return: 1 if added, 0 if the file does not exist, -1 if out of memory
+ */
+int delBatchAdd(struct fs_ctx *fs, struct delBatch *b, char *fname) {
+    struct extMap *m = extMapGet(fs, fname);
+    if (m == NULL)
+        return 0;
+    if (b->nIdx + m->nExt > b->maxIdx) {
+        int *idx = realloc(b->idx, (b->nIdx + m->nExt) * 2 * sizeof(int));
+        if (idx == NULL) {
+            extMapPut(fs, m);
+            return -1;
+        }
+        b->idx = idx;
+        b->maxIdx = (b->nIdx + m->nExt) * 2;
+    }
+    if (b->nBlocks + m->nExt * FBLOCKS > b->maxBlocks) {
+        uint32_t *blocks = realloc(b->blocks, (b->nBlocks + m->nExt * FBLOCKS) * 2 * sizeof(uint32_t));
+        if (blocks == NULL) {
+            extMapPut(fs, m);
+            return -1;
+        }
+        b->blocks = blocks;
+        b->maxBlocks = (b->nBlocks + m->nExt * FBLOCKS) * 2;
+    }
+    for (int e = 0; e < m->nExt; e++)                       // (a sparse file may miss extents)
+        if (m->dirIdx[e] != -1)
+            b->idx[b->nIdx++] = m->dirIdx[e];
+    for (int i = 0; i < m->nExt * FBLOCKS; i++)             // (zero: a hole, or a tiny file)
+        if (m->blocks[i] != 0)
+            b->blocks[b->nBlocks++] = m->blocks[i];
+    extMapPut(fs, m);
+    return 1;
+}
+
+int fnameCompare(const void *a, const void *b) {
+    return memcmp(a, b, FNAMESZ);
+}
+
+/**
+ * delete the n files in names (repeated names count once): their dirents
+ * are cleared in one directory update (each dir block written once) and
+ * then their blocks freed. Each file is traced as an fs_delete call.
+ * return: number of files deleted, -1 if error (not mounted or no memory)
+ */
+int fsDeleteMany(struct fs_ctx *fs, char **names, int n) {
+
+    if (fs->superB.magic != FS_MAGIC) {
+        printf("disc not mounted\n");
+        return -1;
+    }
+    if (n <= 0)
+        return 0;
+    char (*fnames)[FNAMESZ] = malloc(n * FNAMESZ);
+    if (fnames == NULL)
+        return -1;
+    for (int i = 0; i < n; i++)
+        strEncode(fnames[i], names[i], FNAMESZ);
+    qsort(fnames, n, FNAMESZ, fnameCompare);
+
+    char locked[FILELOCKS];
+    memset(locked, FALSE, sizeof(locked));
+    for (int i = 0; i < n; i++)
+        locked[fileLock(fs, fnames[i]) - fs->fileLocks] = TRUE;
+    for (int l = 0; l < FILELOCKS; l++)
+        if (locked[l])
+            pthread_rwlock_wrlock(&fs->fileLocks[l]);
+
+    struct delBatch b;
+    memset(&b, 0, sizeof(b));
+    long long t0 = nowNs();
+    int deleted = 0, r = 0;
+    for (int i = 0; i < n && r != -1; i++)
+        if (i == 0 || memcmp(fnames[i], fnames[i - 1], FNAMESZ) != 0) {
+            deleted += (r = delBatchAdd(fs, &b, fnames[i])) == 1;
+            char name[FNAMESZ + 1];                         // traced as fs_delete(name)
+            strDecode(name, fnames[i], FNAMESZ);
+            traceCall(fs, FS_OP_DELETE, t0, name, 0, 0, -1, r == -1 ? -1 : r == 1 ? 0 : 1);
+        }
+    if (r != -1) {
+        dirRemove(fs, b.idx, b.nIdx);                       // dirents go before their blocks
+        freeBlockList(fs, b.blocks, b.nBlocks);
+    }
+
+    for (int l = FILELOCKS - 1; l >= 0; l--)
+        if (locked[l])
+            pthread_rwlock_unlock(&fs->fileLocks[l]);
+    free(b.idx);
+    free(b.blocks);
+    free(fnames);
+    return r != -1 ? deleted : -1;
+}
+
+/**
+ * delete all files whose names match pattern (fnmatch(3) wildcards, case
+ * is ignored as in file names)
+ * return: number of files deleted, -1 if error
+ */
+int fsDeletePattern(struct fs_ctx *fs, char *pattern) {
+
+    if (fs->superB.magic != FS_MAGIC) {
+        printf("disc not mounted\n");
+        return -1;
+    }
+    char *pat = strdup(pattern);
+    if (pat == NULL)
+        return -1;
+    for (int i = 0; pat[i] != '\0'; i++)
+        pat[i] = (char) toupper(pat[i]);
+
+    int n = 0;
+    char (*found)[FNAMESZ + 1] = NULL;
+    pthread_rwlock_rdlock(&fs->dirLock);
+    found = malloc(fs->dirBlocks * DIRENTS_PER_BLOCK * (FNAMESZ + 1) + 1);
+    for (int i = 0; found != NULL && i < fs->dirBlocks * DIRENTS_PER_BLOCK; i++)
+        if (ISFILE(&fs->dirCache[i])) {
+            strDecode(found[n], fs->dirCache[i].name, FNAMESZ);
+            if (fnmatch(pat, found[n], 0) == 0)
+                n++;
+        }
+    pthread_rwlock_unlock(&fs->dirLock);
+    free(pat);
+
+    char **names = malloc(n * sizeof(char *) + 1);
+    int r = -1;
+    if (found != NULL && names != NULL) {
+        for (int i = 0; i < n; i++)
+            names[i] = found[i];
+        r = fsDeleteMany(fs, names, n);                     // (files gone since are skipped)
+    }
+    free(names);
+    free(found);
+    return r;
+}
+
+int fsDelete(struct fs_ctx *fs, char *name) {
+    int r = fsDeleteMany(fs, &name, 1);
+    return r == -1 ? -1 : r == 1 ? 0 : 1;                   // 1: FILE DOES NOT EXIST
+}
+
+int fs_ctx_delete(struct fs_ctx *fs, char *name) {
+    long long t0 = opBegin(fs, FS_OP_DELETE);
+    int r = fsDelete(fs, name);
+    opEnd(fs, FS_OP_DELETE, t0);
+    return r;
+}
+
+int fs_delete(char *name) {
+    return fs_ctx_delete(defaultCtx(), name);
+}
+
+int fs_ctx_delete_many(struct fs_ctx *fs, char **names, int n) {
+    long long t0 = opBegin(fs, FS_OP_DELETE);
+    int r = fsDeleteMany(fs, names, n);
+    opEnd(fs, FS_OP_DELETE, t0);
+    return r;
+}
+
+int fs_delete_many(char **names, int n) {
+    return fs_ctx_delete_many(defaultCtx(), names, n);
+}
+
+int fs_ctx_delete_pattern(struct fs_ctx *fs, char *pattern) {
+    long long t0 = opBegin(fs, FS_OP_DELETE);
+    int r = fsDeletePattern(fs, pattern);
+    opEnd(fs, FS_OP_DELETE, t0);
+    return r;
+}
+
+int fs_delete_pattern(char *pattern) {
+    return fs_ctx_delete_pattern(defaultCtx(), pattern);
+}
+
+/*****************************************************/
+
+void fsDir(struct fs_ctx *fs) {
+
+    if (fs->superB.magic != FS_MAGIC) {
+        printf("disc not mounted\n");
+        return;
+    }
+
+    // TODO: list files
+    // printf( "%u: %s, size: %u bytes\n", dirent_number, file_name, file_size)
+
+    pthread_rwlock_rdlock(&fs->dirLock);
+    for(int i = 0; i < fs->dirBlocks * DIRENTS_PER_BLOCK; i++) {  // (dirCache: no disk reads)
+        struct fs_dirent *dirent = &fs->dirCache[i];
+        if(ISFILE(dirent)) {
+            char file_name[FNAMESZ + 1];
+            strDecode(file_name, dirent->name, FNAMESZ);
+            unsigned int file_size = (unsigned int) fileSize(fs, dirent);
+            unsigned int dirent_number = (unsigned int) i;
+            printf("%u: %s, size: %u bytes\n", dirent_number, file_name, file_size);
+        }
+    }
+    pthread_rwlock_unlock(&fs->dirLock);
+}
+
+void fs_ctx_dir(struct fs_ctx *fs) {
+    long long t0 = opBegin(fs, FS_OP_DIR);
+    fsDir(fs);
+    opEnd(fs, FS_OP_DIR, t0);
+    traceCall(fs, FS_OP_DIR, t0, NULL, 0, 0, -1, 0);
+}
+
+void fs_dir() {
+    fs_ctx_dir(defaultCtx());
+}
+/*****************************************************/
+
+void fs_ctx_debug(struct fs_ctx *fs) {
+    union fs_block block;
+
+    pthread_mutex_lock(&fs->superLock);
+    cacheRead(fs, SBLOCK, block.data);
+
+    if ((block.super.magic & FS_MAGIC_MASK) != FS_MAGIC) {
+        pthread_mutex_unlock(&fs->superLock);
+        printf("disk unformatted !\n");
+        return;
+    }
+    dumpSB(fs);
+    pthread_mutex_unlock(&fs->superLock);
+
+    printf("**************************************\n");
+    if (fs->superB.magic == FS_MAGIC) {
+        printf("Used blocks: ");
+        pthread_mutex_lock(&fs->allocLock);
+        for (int i = 0; i < fs->fsBlocks; i++) {
+            if (BITMAP_TEST(i) == NOT_FREE)
+                printf(" %d", i);
+        }
+        pthread_mutex_unlock(&fs->allocLock);
+        puts("\nFiles:\n");
+        fs_ctx_dir(fs);
+    }
+    printf("**************************************\n");
+}
+
+void fs_debug() {
+    fs_ctx_debug(defaultCtx());
+}
+
+/*****************************************************/
+
+/**
+ * return: log2 of the number of disk blocks in an FS block of bsize bytes,
+ * or -1 if bsize is not DISK_BLOCK_SIZE times a power of 2 up to MAXBLOCKSZ
+ */
+int blockShiftOf(int bsize) {
+    for (int shift = 0; DISK_BLOCK_SIZE << shift <= MAXBLOCKSZ; shift++)
+        if (DISK_BLOCK_SIZE << shift == bsize)
+            return shift;
+    return -1;
+}
+
+int fsFormat(struct fs_ctx *fs, char *disklabel) {
+    union fs_block block;
+    int nblocks;
+
+    assert(sizeof(struct fs_dirent) == 48 && sizeof(struct fs_dirent16) == 32);
+    assert(sizeof(struct fs_sblock) <= DISK_BLOCK_SIZE && sizeof(struct fs_sblock2) <= DISK_BLOCK_SIZE);
+    assert(sizeof(union fs_block) == MAXBLOCKSZ);
+
+    if (fs->superB.magic == FS_MAGIC) {
+        printf("Cannot format a mounted disk!\n");
+        return 0;
+    }
+    nblocks = fs->disk->size(fs->disk);
+    int bsize = fs->formatBlockSize;
+    if (bsize == 0 && nblocks > UINT16_MAX)                 // too large for 16 bit block numbers
+        bsize = LARGEBLOCKSZ;
+    int large = bsize != 0;
+    fs->blockShift = large ? blockShiftOf(bsize) : 0;
+    fs->blockSize = DISK_BLOCK_SIZE << fs->blockShift;
+    nblocks >>= fs->blockShift;                             // (in FS blocks)
+    int nbm = BITMAPBLKS(nblocks);
+    int used = nbm + (large ? 3 : 2);                       // superblock, bitmap, 1st dir block
+    if (nblocks < used) {                                   // (and its indirect dir block)
+        printf("Disk too small\n");
+        return 0;
+    }
+    memset(&block, 0, sizeof(block));
+    cacheWrite(fs, nbm + 1, block.data); // write 1st dir block all zeros
+    for (int i = 0; i < nbm; i++) {  // bitmap: superblock, bitmap and 1st dir block used
+        memset(&block, 0, sizeof(block));
+        for (int b = i * BLOCKSZ * 8; b < used && b < (i + 1) * BLOCKSZ * 8; b++)
+            block.data[(b % (BLOCKSZ * 8)) / 8] |= 1 << (b % 8);
+        cacheWrite(fs, 1 + i, block.data);
+    }
+
+    memset(&block, 0, sizeof(block));
+    if (large) {
+        ((uint32_t *) block.data)[0] = nbm + 1;
+        cacheWrite(fs, nbm + 2, block.data); // write the indirect dir block listing it
+        memset(&block, 0, sizeof(block));
+        block.super2.magic = FS_MAGIC | FS_F_BITMAP | FS_F_SIZE32 | FS_F_LARGE | FS_F_EXT32;
+        block.super2.blockShift = (uint16_t) fs->blockShift;
+        block.super2.fssize = (uint32_t) nblocks;
+        strEncode(block.super2.label, disklabel, LABELSZ);
+        block.super2.indirect[0] = nbm + 2;
+    } else {
+        block.super.magic = FS_MAGIC | FS_F_BITMAP | FS_F_SIZE32 | FS_F_EXT32;
+        block.super.fssize = nblocks;
+        strEncode(block.super.label, disklabel, LABELSZ);
+        block.super.dir[0] = nbm + 1; // first dir block after the bitmap
+    }
+
+    cacheWrite(fs, 0, block.data); // write superblock
+    dumpSB(fs); // debug
+
+    return 1;
+}
+
+int fs_ctx_format(struct fs_ctx *fs, char *disklabel) {
+    long long t0 = opBegin(fs, FS_OP_FORMAT);
+    int r = fsFormat(fs, disklabel);
+    opEnd(fs, FS_OP_FORMAT, t0);
+    traceCall(fs, FS_OP_FORMAT, t0, disklabel, 0, 0, -1, r);
+    return r;
+}
+
+int fs_format(char *disklabel) {
+    return fs_ctx_format(defaultCtx(), disklabel);
+}
+
+/*****************************************************************/
+
+/**
+ * release the in-memory state built by mount (bitmap, block references
+ * and directory)
+ */
+void mountFree(struct fs_ctx *fs) {
+    free(fs->dirCache);
+    free(fs->dirHashNext);
+    free(fs->dirHashHead);
+    free(fs->dirList);
+    free(fs->blockBitMap);
+    free(fs->blockRefs);
+    fs->dirCache = NULL;
+    fs->dirHashNext = NULL;
+    fs->dirHashHead = NULL;
+    fs->dirList = NULL;
+    fs->blockBitMap = NULL;
+    fs->blockRefs = NULL;
+    fs->dirBlocks = 0;
+}
+
+int fsMount(struct fs_ctx *fs) {
+    union fs_block block;
+
+    if (fs->superB.magic == FS_MAGIC) {
+        printf("One disc is already mounted!\n");
+        return 0;
+    }
+    fs->blockShift = 0;                                     // (until the superblock says)
+    fs->blockSize = DISK_BLOCK_SIZE;
+    cacheRead(fs, 0, block.data);
+    fs->superB = block.super;
+    fs->fsFeatures = fs->superB.magic & ~FS_MAGIC_MASK & ~FS_F_DIRTY;
+    fs->fsDirty = (fs->superB.magic & FS_F_DIRTY) != 0;
+    fs->superB.magic &= FS_MAGIC_MASK;
+    fs->fsBlocks = fs->superB.fssize;
+    fs->direntsPerBlock = BLOCKSZ / sizeof(struct fs_dirent16);
+    fs->maxDirBlocks = MAXDIRSZ;
+
+    if (fs->superB.magic != FS_MAGIC) {
+        printf("cannot mount an unformatted disc!\n");
+        return 0;
+    }
+    if ((fs->fsFeatures & FS_F_EXT32) && !(fs->fsFeatures & FS_F_SIZE32)) { // (fs_format sets both)
+        printf("unsupported block size or features!\n");
+        fs->superB.magic = 0;
+        return 0;
+    }
+    if (fs->fsFeatures & FS_F_LARGE) {                      // a fs_sblock2
+        fs->blockShift = blockShiftOf(DISK_BLOCK_SIZE << MIN(block.super2.blockShift, 16));
+        if (fs->blockShift == -1 || !(fs->fsFeatures & FS_F_SIZE32)) { // (fs_format sets it)
+            printf("unsupported block size or features!\n");
+            fs->blockShift = 0;
+            fs->superB.magic = 0;
+            return 0;
+        }
+        fs->blockSize = DISK_BLOCK_SIZE << fs->blockShift;
+        fs->fsBlocks = (int) block.super2.fssize;
+        fs->direntsPerBlock = BLOCKSZ / sizeof(struct fs_dirent);
+        fs->maxDirBlocks = MIN(MIN(SB2INDIRECT * DIRLISTPB, MAXDIRENTS / DIRENTS_PER_BLOCK),
+                               fs->fsBlocks);
+        memcpy(fs->superB.label, block.super2.label, LABELSZ);
+        memset(fs->superB.dir, 0, sizeof(fs->superB.dir));
+        memcpy(fs->dirIndirect, block.super2.indirect, sizeof(fs->dirIndirect));
+    }
+    if (fs->fsBlocks != fs->disk->size(fs->disk) >> fs->blockShift) {
+        printf("file system size and disk size differ!\n");
+        fs->superB.magic = 0;
+        return 0;
+    }
+    if (cacheInit(fs) == -1)
+        printf("no memory for the block cache, using the disk directly\n");
+
+    // build used blocks map (clean disk with a stored bitmap: just read it)
+    int nbm = BITMAPBLKS(fs->fsBlocks);
+    int loadBitMap = (fs->fsFeatures & FS_F_BITMAP) && !fs->fsDirty;
+    struct blockVec vec[VECMAX];
+    int nvec = 0;
+    fs->bitMapWords = (fs->fsBlocks + 63) / 64;
+    fs->blockBitMap = calloc(nbm, BLOCKSZ);
+    uint64_t *seen = calloc(fs->bitMapWords, sizeof(uint64_t)); // blocks referenced by a dirent
+    int nlist = (fs->maxDirBlocks + DIRLISTPB - 1) / DIRLISTPB * DIRLISTPB;
+    fs->dirList = calloc(nlist, sizeof(uint32_t));
+    char *buf = malloc(VECMAX * BLOCKSZ);                   // dir blocks being read
+    if (fs->blockBitMap == NULL || seen == NULL || fs->dirList == NULL || buf == NULL) {
+        printf("no memory for the directory!\n");
+        free(seen);
+        free(buf);
+        mountFree(fs);
+        cacheFree(fs);
+        fs->superB.magic = 0;
+        return 0;
+    }
+    for (int i = 0; loadBitMap && i < nbm; i += nvec) {    // (in vectored batches)
+        for (nvec = 0; nvec < VECMAX && i + nvec < nbm; nvec++) {
+            vec[nvec].block = 1 + i + nvec;
+            vec[nvec].buf = (char *) fs->blockBitMap + (i + nvec) * BLOCKSZ;
+        }
+        blockIOv(fs, vec, nvec, FALSE);
+    }
+    for (int i = fs->fsBlocks; i < fs->bitMapWords * 64; i++)
+        BITMAP_SET(i); // past the end of the disk
+    BITMAP_SET(0); // 0 is used by superblock
+    for (int i = 0; (fs->fsFeatures & FS_F_BITMAP) && i < nbm; i++)
+        BITMAP_SET(1 + i);
+    fs->allocCursor = 0;
+
+    // the list of dir blocks: in superB, or in the indirect dir blocks
+    for (int i = 0; !(fs->fsFeatures & FS_F_LARGE) && i < MAXDIRSZ; i++)
+        fs->dirList[i] = fs->superB.dir[i];
+    for (int j = 0; (fs->fsFeatures & FS_F_LARGE) && j * DIRLISTPB < nlist; j++)
+        if (fs->dirIndirect[j] != 0) {
+            cacheRead(fs, fs->dirIndirect[j], (char *) &fs->dirList[j * DIRLISTPB]);
+            BITMAP_SET(fs->dirIndirect[j]);
+        }
+
+    // else blockBitMap[i]=NOT_FREE if block i is in use: check all directory
+    // (dropping the dirents a crashed dirCompact left twice) and load the
+    // directory into dirCache and its hash index
+    int n;
+    for(n = 0; n < fs->maxDirBlocks && fs->dirList[n]; n++)
+        ;
+    fs->dirBlocks = 0;
+    fs->dirFree = 0;
+    if(dirCacheGrow(fs, n) == -1) {
+        printf("no memory for the directory!\n");
+        free(seen);
+        free(buf);
+        mountFree(fs);
+        cacheFree(fs);
+        fs->superB.magic = 0;
+        return 0;
+    }
+    for(int m = 0; m < NEXTMAPS; m++)
+        fs->extMaps[m].used = fs->extMaps[m].refs = 0;
+    for(int h = 0; h < MAXOPEN; h++)
+        fs->openFiles[h] = NULL;
+
+    for(int i = 0; i < fs->dirBlocks; i += nvec) {          // read it in vectored batches
+        for(nvec = 0; nvec < VECMAX && i + nvec < fs->dirBlocks; nvec++) {
+            vec[nvec].block = fs->dirList[i + nvec];
+            vec[nvec].buf = buf + nvec * BLOCKSZ;
+        }
+        blockIOv(fs, vec, nvec, FALSE);
+        for(int j = 0; j < nvec; j++)                       // (buf has them in dir order)
+            dirBlockDecode(fs, i + j, buf + j * BLOCKSZ);
+    }
+    free(buf);
+    int noMem = FALSE;
+    for(int i = 0; i < fs->dirBlocks; i++) {
+        int copies = FALSE;
+        BITMAP_SET(fs->dirList[i]);
+        for (int j = 0; j < DIRENTS_PER_BLOCK; j++) {
+            int idx = i * DIRENTS_PER_BLOCK + j;
+            struct fs_dirent *dirent = &fs->dirCache[idx];
+            if (!loadBitMap && (ISFILE(dirent) || ISEXT(dirent)) &&
+                dirLookup(fs, dirent->name, ISEXT(dirent) ? EXTID(dirent) : 0) != -1) {
+                memset(dirent, 0, sizeof(*dirent));         // a stale copy (see dirCompact)
+                copies = TRUE;
+            }
+            if (ISFILE(dirent) || ISEXT(dirent))
+                for (int k = 0; k < BLOCKPTRS(dirent); k++) {
+                    int b = dirent->blocks[k];
+                    if (b == 0 || b >= fs->fsBlocks)        // (a hole, or not a block)
+                        continue;
+                    if (!loadBitMap)
+                        BITMAP_SET(b);
+                    if (!((seen[b / 64] >> (b % 64)) & 1))  // first reference
+                        seen[b / 64] |= (uint64_t) 1 << (b % 64);
+                    else if (blockRefsAlloc(fs) == 0)       // a shared block (clones)
+                        fs->blockRefs[b]++;
+                    else
+                        noMem = TRUE;
+                }
+            dirIndexAdd(fs, idx);
+        }
+        if (copies)
+            dirBlockWrite(fs, i);
+    }
+    free(seen);
+    if (noMem) {
+        printf("no memory for the block references!\n");
+        mountFree(fs);
+        cacheFree(fs);
+        fs->superB.magic = 0;
+        return 0;
+    }
+    fs->freeBlocks = fs->bitMapWords * 64;
+    for (int w = 0; w < fs->bitMapWords; w++)
+        fs->freeBlocks -= __builtin_popcountll(fs->blockBitMap[w]);
+    return 1;
+}
+
+int fs_ctx_mount(struct fs_ctx *fs) {
+    long long t0 = opBegin(fs, FS_OP_MOUNT);
+    int r = fsMount(fs);
+    opEnd(fs, FS_OP_MOUNT, t0);
+    traceCall(fs, FS_OP_MOUNT, t0, NULL, 0, 0, -1, r);
+    return r;
+}
+
+int fs_mount() {
+    return fs_ctx_mount(defaultCtx());
+}
+
+int fsUnmount(struct fs_ctx *fs) {
+
+    if (fs->superB.magic != FS_MAGIC) {
+        printf("disc not mounted\n");
+        return 0;
+    }
+    aioDrain(fs);
+    syncAll(fs);
+    cacheFree(fs);
+    for (int m = 0; m < NEXTMAPS; m++) {
+        free(fs->extMaps[m].dirIdx);
+        free(fs->extMaps[m].blocks);
+        free(fs->extMaps[m].zLen);
+        memset(&fs->extMaps[m], 0, sizeof(struct extMap));
+    }
+    for (int h = 0; h < MAXOPEN; h++)
+        fs->openFiles[h] = NULL;
+    mountFree(fs);
+    fs->superB.magic = 0;
+    return 1;
+}
+
+int fs_ctx_unmount(struct fs_ctx *fs) {
+    long long t0 = opBegin(fs, FS_OP_UNMOUNT);
+    int r = fsUnmount(fs);
+    opEnd(fs, FS_OP_UNMOUNT, t0);
+    traceCall(fs, FS_OP_UNMOUNT, t0, NULL, 0, 0, -1, r);
+    return r;
+}
+
+int fs_unmount() {
+    return fs_ctx_unmount(defaultCtx());
+}
+
+/**
+ * unmount (if mounted) and release context fs (and its async workers)
+ */
+void fs_ctx_free(struct fs_ctx *fs) {
+    if (fs->superB.magic == FS_MAGIC)
+        fsUnmount(fs);
+    aioShutdown(fs);
+    fs_ctx_trace_stop(fs);
+    pthread_mutex_lock(&ctxListLock);
+    struct fs_ctx **p = &ctxList;
+    while (*p != fs)
+        p = &(*p)->nextCtx;
+    *p = fs->nextCtx;
+    pthread_mutex_unlock(&ctxListLock);
+    for (int i = 0; i < FILELOCKS; i++)
+        pthread_rwlock_destroy(&fs->fileLocks[i]);
+    pthread_rwlock_destroy(&fs->dirLock);
+    pthread_mutex_destroy(&fs->allocLock);
+    pthread_mutex_destroy(&fs->superLock);
+    pthread_mutex_destroy(&fs->cacheLock);
+    pthread_mutex_destroy(&fs->mapLock);
+    pthread_cond_destroy(&fs->mapFree);
+    pthread_mutex_destroy(&fs->aioLock);
+    pthread_cond_destroy(&fs->aioWork);
+    pthread_cond_destroy(&fs->aioDone);
+    pthread_mutex_destroy(&fs->traceLock);
+    free(fs);
+}
+
+/*****************************************************************/
+
+int fsSync(struct fs_ctx *fs) {
+
+    if (fs->superB.magic != FS_MAGIC) {
+        printf("disc not mounted\n");
+        return 0;
+    }
+    syncAll(fs);
+    return 1;
+}
+
+int fs_ctx_sync(struct fs_ctx *fs) {
+    long long t0 = opBegin(fs, FS_OP_SYNC);
+    int r = fsSync(fs);
+    opEnd(fs, FS_OP_SYNC, t0);
+    traceCall(fs, FS_OP_SYNC, t0, NULL, 0, 0, -1, r);
+    return r;
+}
+
+int fs_sync() {
+    return fs_ctx_sync(defaultCtx());
+}
+
+/**
+ * set the block cache size (0 = no cache) and write mode; when mounted the
+ * cache is flushed and rebuilt
+ */
+int fs_ctx_cache_config(struct fs_ctx *fs, int nblocks, int writeThrough) {
+
+    if (nblocks < 0)
+        return 0;
+    int mounted = fs->superB.magic == FS_MAGIC;
+    if (mounted)
+        cacheFree(fs);
+    fs->cacheSize = nblocks;
+    fs->cacheWriteThrough = writeThrough;
+    if (mounted && cacheInit(fs) == -1) {
+        printf("no memory for the block cache, using the disk directly\n");
+        return 0;
+    }
+    return 1;
+}
+
+int fs_cache_config(int nblocks, int writeThrough) {
+    return fs_ctx_cache_config(defaultCtx(), nblocks, writeThrough);
+}
+
+/**
+ * set the max read-ahead window in blocks (0 = no read-ahead)
+ * return: previous value
+ */
+int fs_ctx_readahead_config(struct fs_ctx *fs, int maxBlocks) {
+    int old = fs->raMax;
+
+    if (maxBlocks >= 0)
+        fs->raMax = maxBlocks;
+    return old;
+}
+
+int fs_readahead_config(int maxBlocks) {
+    return fs_ctx_readahead_config(defaultCtx(), maxBlocks);
+}
+
+void fs_ctx_cache_stats(struct fs_ctx *fs, struct fs_cache_stats *stats) {
+    statsLoad((unsigned long *) stats, (unsigned long *) &fs->cacheStats,
+              sizeof(fs->cacheStats) / sizeof(unsigned long));
+}
+
+void fs_cache_stats(struct fs_cache_stats *stats) {
+    fs_ctx_cache_stats(defaultCtx(), stats);
+}
+
+/**
+ * set compression of the extents written from now on: when on, each
+ * extent written in full (or written into, if compressed) is stored LZ
+ * compressed if that saves blocks. Compressed extents are always read.
+ * return: previous value
+ */
+int fs_ctx_compress_config(struct fs_ctx *fs, int on) {
+    int old = fs->compress;
+
+    fs->compress = on != 0;
+    return old;
+}
+
+int fs_compress_config(int on) {
+    return fs_ctx_compress_config(defaultCtx(), on);
+}
+
+/**
+ * set the format of the disks formatted from now on: with blockSize 0 the
+ * 16 bit format (1 KB blocks) if the disk is small enough for it, else
+ * FS_F_LARGE with LARGEBLOCKSZ blocks; else FS_F_LARGE with blockSize byte
+ * blocks (DISK_BLOCK_SIZE times a power of 2, up to MAXBLOCKSZ)
+ * return: previous value, or -1 if blockSize is not valid (nothing set)
+ */
+int fs_ctx_format_config(struct fs_ctx *fs, int blockSize) {
+    int old = fs->formatBlockSize;
+
+    if (blockSize != 0 && blockShiftOf(blockSize) == -1) {
+        printf("invalid block size %d\n", blockSize);
+        return -1;
+    }
+    fs->formatBlockSize = blockSize;
+    return old;
+}
+
+int fs_format_config(int blockSize) {
+    return fs_ctx_format_config(defaultCtx(), blockSize);
+}
+
+/************************************************************/
+
+/**
+ * append a length (n - 15, the token holding 15) to out, 255 per byte
+ */
+uint8_t *lzLength(uint8_t *out, int n) {
+    for (n -= 15; n >= 255; n -= 255)
+        *out++ = 255;
+    *out++ = (uint8_t) n;
+    return out;
+}
+
+/**
+ * append to out (end: end of the output) a sequence of the nlit bytes at
+ * lit and, if len > 0, a match of len bytes at off bytes back
+ * return: the new out, or NULL if it does not fit (or out is NULL)
+ */
+uint8_t *lzSequence(uint8_t *out, uint8_t *end, const uint8_t *lit, int nlit, int off, int len) {
+    int ml = len - LZMINMATCH;
+
+    if (out == NULL || end - out < 1 + nlit / 255 + 1 + nlit + (len > 0 ? 2 + ml / 255 + 1 : 0))
+        return NULL;
+    *out++ = (uint8_t) (MIN(nlit, 15) << 4 | (len > 0 ? MIN(ml, 15) : 0));
+    if (nlit >= 15)
+        out = lzLength(out, nlit);
+    memcpy(out, lit, nlit);
+    out += nlit;
+    if (len > 0) {
+        *out++ = (uint8_t) off;
+        *out++ = (uint8_t) (off >> 8);
+        if (ml >= 15)
+            out = lzLength(out, ml);
+    }
+    return out;
+}
+
+/**
+ * LZ compress the n bytes of src (n <= 65536) into dst, if they fit in max
+ * bytes. The output is a list of sequences: a token byte (number of
+ * literals in the high 4 bits, match length - LZMINMATCH in the low ones,
+ * 15 meaning more in the next bytes, 255 per byte), the literals, then the
+ * match as a 2 byte offset back into the output (the last one has none).
+ * Matches are found with a hash table of the last position of 4 bytes.
+ * return: compressed length, or 0 if it does not fit
+ */
+int lzCompress(const char *src, int n, char *dst, int max) {
+    const uint8_t *in = (const uint8_t *) src;
+    uint8_t *out = (uint8_t *) dst, *end = out + max;
+    uint32_t table[1 << LZHASHBITS]; // hash -> last position + 1 (0 = none)
+    int anchor = 0;                  // first byte not in a sequence yet
+
+    memset(table, 0, sizeof(table));
+    for (int i = 0; i + LZMINMATCH <= n && out != NULL;) {
+        uint32_t seq;
+        memcpy(&seq, in + i, sizeof(seq));
+        unsigned int h = (seq * 2654435761u) >> (32 - LZHASHBITS);
+        int cand = table[h] - 1;
+        table[h] = (uint32_t) (i + 1);
+        if (cand < 0 || memcmp(in + cand, in + i, LZMINMATCH) != 0) {
+            i += 1 + ((i - anchor) >> 5);                   // (faster over incompressible data)
+            continue;
+        }
+        int len = LZMINMATCH;
+        while (i + len < n && in[cand + len] == in[i + len])
+            len++;
+        out = lzSequence(out, end, in + anchor, i - anchor, i - cand, len);
+        i += len;
+        anchor = i;
+    }
+    out = lzSequence(out, end, in + anchor, n - anchor, 0, 0);
+    return out != NULL ? (int) (out - (uint8_t *) dst) : 0;
+}
+
+/**
+ * read a length continued after its token (n: the 15 in the token)
+ * return: the length, or -1 if past end
+ */
+int lzReadLength(const uint8_t **in, const uint8_t *end, int n) {
+    int c;
+
+    do {
+        if (*in >= end)
+            return -1;
+        c = *(*in)++;
+        n += c;
+    } while (c == 255);
+    return n;
+}
+
+/**
+ * decompress the n bytes of LZ data in src (see lzCompress) into dst
+ * return: decompressed length, or -1 if src is corrupt or its data does
+ * not fit in max bytes
+ */
+int lzDecompress(const char *src, int n, char *dst, int max) {
+    const uint8_t *in = (const uint8_t *) src, *inEnd = in + n;
+    uint8_t *out = (uint8_t *) dst, *outEnd = out + max;
+
+    while (in < inEnd) {
+        int token = *in++;
+        int nlit = token >> 4, len = token & 15;
+        if (nlit == 15 && (nlit = lzReadLength(&in, inEnd, nlit)) == -1)
+            return -1;
+        if (nlit > inEnd - in || nlit > outEnd - out)
+            return -1;
+        memcpy(out, in, nlit);
+        in += nlit;
+        out += nlit;
+        if (in == inEnd)
+            break;                                          // last sequence: no match
+        if (inEnd - in < 2)
+            return -1;
+        int off = in[0] | in[1] << 8;
+        in += 2;
+        if (len == 15 && (len = lzReadLength(&in, inEnd, len)) == -1)
+            return -1;
+        len += LZMINMATCH;
+        if (off == 0 || off > out - (uint8_t *) dst || len > outEnd - out)
+            return -1;
+        for (int i = 0; i < len; i += off)                  // (in pieces not overlapping their source)
+            memcpy(out + i, out + i - off, MIN(off, len - i));
+        out += len;
+    }
+    return (int) (out - (uint8_t *) dst);
+}
+
+const char zeroBlock[MAXBLOCKSZ]; // a block of zeros
+
+/**
+ * read the n disk blocks in 'blocks' to buf (block i at buf + i*BLOCKSZ),
+ * holes as zeros, the blocks not cached in one vectored request
+ */
+void blocksRead(struct fs_ctx *fs, const uint32_t *blocks, int n, char *buf) {
+    struct blockVec vec[FBLOCKS];
+    int nvec = 0;
+
+    for (int i = 0; i < n && i < FBLOCKS; i++)
+        if (blocks[i] == 0)
+            memset(buf + i * BLOCKSZ, 0, BLOCKSZ);
+        else if (!cacheLookup(fs, blocks[i], buf + i * BLOCKSZ)) {
+            vec[nvec].block = blocks[i];
+            vec[nvec++].buf = buf + i * BLOCKSZ;
+        }
+    blockIOv(fs, vec, nvec, FALSE);
+}
+
+/**
+ * read the EXTSZ bytes of extent ext of the file with map m to buf,
+ * decompressing it if compressed (holes and missing extents are zeros)
+ * return: 0 if ok, -1 if its compressed data is corrupt
+ */
+int extentLoad(struct fs_ctx *fs, struct extMap *m, int ext, char *buf) {
+    char zbuf[MAXEXTSZ];
+
+    if (ext >= m->nExt)
+        memset(buf, 0, EXTSZ);
+    else if (m->zLen[ext] == 0)
+        blocksRead(fs, &m->blocks[ext * FBLOCKS], FBLOCKS, buf);
+    else {
+        int zlen = m->zLen[ext];
+        if (zlen <= (FBLOCKS - 1) * BLOCKSZ)
+            blocksRead(fs, &m->blocks[ext * FBLOCKS], (zlen + BLOCKSZ - 1) / BLOCKSZ, zbuf);
+        if (zlen > (FBLOCKS - 1) * BLOCKSZ || lzDecompress(zbuf, zlen, buf, EXTSZ) != EXTSZ) {
+            char name[FNAMESZ + 1];
+            strDecode(name, m->name, FNAMESZ);
+            printf("%s: extent %d is corrupt\n", name, ext);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * store the EXTSZ bytes of buf as extent ext of the file with map m (a new
+ * extent if it has no dirent): compressed if compression is on and that
+ * takes fewer blocks than the non-zero blocks of buf, else in plain blocks
+ * (zero blocks as holes), but a plain extent to stay plain is not stored.
+ * New blocks are written before the dirent points to them and the old
+ * ones are freed after.
+ * return: 0 if stored, 1 if not (plain), -1 if no disk or directory space
+ * (the extent is unchanged)
+ */
+int extentStore(struct fs_ctx *fs, struct extMap *m, int ext, const char *buf) {
+    char zbuf[MAXEXTSZ];
+    uint32_t newB[FBLOCKS], oldB[FBLOCKS];
+    struct blockVec vec[FBLOCKS];
+    int nz = 0, zlen = 0, got = 0, nvec = 0;
+
+    for (int i = 0; i < FBLOCKS; i++)
+        nz += memcmp(buf + i * BLOCKSZ, zeroBlock, BLOCKSZ) != 0;
+    if (fs->compress)
+        zlen = lzCompress(buf, EXTSZ, zbuf, (FBLOCKS - 1) * BLOCKSZ);
+    int need = zlen > 0 ? (zlen + BLOCKSZ - 1) / BLOCKSZ : FBLOCKS;
+    int zip = need < nz;
+    int idx = ext < m->nExt ? m->dirIdx[ext] : -1;
+    if (!zip && (idx == -1 || m->zLen[ext] == 0))
+        return 1;                                           // plain, and stays so
+    if (!zip)
+        need = nz;
+    while (got < need) {
+        int count, b = allocRun(fs, got > 0 ? newB[got - 1] + 1 : 0, need - got, &count);
+        if (b == -1) {
+            freeBlockList(fs, newB, got);
+            return -1;                                      // NO MORE DISK SPACE
+        }
+        for (int i = 0; i < count; i++)
+            newB[got++] = (uint32_t) (b + i);
+    }
+
+    struct fs_dirent entry;
+    if (idx != -1)
+        entry = fs->dirCache[idx];
+    else {                                                  // new extent
+        memset(&entry, 0, sizeof(entry));
+        memcpy(entry.name, m->name, FNAMESZ);
+        if (fs->fsFeatures & FS_F_EXT32)
+            entry.ext = (uint32_t) ext;
+        else
+            entry.ex = (uint16_t) ext;
+        if (!(fs->fsFeatures & FS_F_SIZE32))
+            entry.ss = fs->dirCache[m->dirIdx[0]].ss;
+    }
+    memset(entry.blocks, 0, sizeof(entry.blocks));
+    if (zip) {
+        memset(zbuf + zlen, 0, need * BLOCKSZ - zlen);
+        for (int i = 0; i < need; i++) {
+            entry.blocks[i] = newB[i];
+            vec[nvec].block = newB[i];
+            vec[nvec++].buf = zbuf + i * BLOCKSZ;
+        }
+        ZLEN(&entry) = (uint16_t) zlen;
+    } else
+        for (int i = 0; i < FBLOCKS; i++)
+            if (memcmp(buf + i * BLOCKSZ, zeroBlock, BLOCKSZ) != 0) {
+                entry.blocks[i] = newB[nvec];
+                vec[nvec].block = newB[nvec];
+                vec[nvec++].buf = (char *) buf + i * BLOCKSZ;
+            }
+    entry.st = ext == 0 ? (zip ? TZFILE : TFILE) : (zip ? TZEXT : TEXT);
+    for (int i = 0; i < nvec; i++)                          // (stale cached copies are replaced)
+        if (cacheUpdate(fs, vec[i].block, vec[i].buf))
+            vec[i--] = vec[--nvec];
+    blockIOv(fs, vec, nvec, TRUE);
+    memset(oldB, 0, sizeof(oldB));
+    if (idx != -1)
+        memcpy(oldB, &m->blocks[ext * FBLOCKS], sizeof(oldB));
+    if (writeFileEntry(fs, idx, entry) == -1) {
+        freeBlockList(fs, newB, need);
+        return -1;                                          // directory is full
+    }
+    freeBlockList(fs, oldB, FBLOCKS);
+    return 0;
+}
+
+/************************************************************/
+
+/**
+ * copy n bytes at offset off of compressed extent ext of the file with
+ * map m to dst (decompressing the whole extent)
+ * return: 0 if ok, -1 if corrupt
+ */
+int extentRead(struct fs_ctx *fs, struct extMap *m, int ext, char *dst, int off, int n) {
+    char buf[MAXEXTSZ];
+
+    if (extentLoad(fs, m, ext, buf) == -1)
+        return -1;
+    memcpy(dst, buf + off, n);
+    return 0;
+}
+
+/**
+ * read up to length bytes at offset of the file with map m; holes (no
+ * block) read as zeros, with no disk I/O, and compressed extents are
+ * decompressed
+ * return: number of bytes read
+ */
+int fileRead(struct fs_ctx *fs, struct extMap *m, char *data, int length, int offset) {
+    struct fs_dirent *first = &fs->dirCache[m->dirIdx[0]];
+    int size = fileSize(fs, first);
+    if (offset >= size || length <= 0)
+        return 0;
+    if (length > size - offset)
+        length = size - offset;
+    if (first->st == TINLINE) {                             // tiny file: data is in its dirent
+        memcpy(data, (char *) first->blocks + offset, length);
+        return length;
+    }
+
+    union fs_block block;
+    struct blockVec vec[VECMAX];                            // whole blocks read straight into data
+    int nvec = 0;
+    int bytesRead = 0;
+    while (bytesRead < length) {
+        int fileBlock = (offset + bytesRead) / BLOCKSZ;     // numero do bloco do ficheiro
+        int blockOffset = (offset + bytesRead) % BLOCKSZ;
+        int n = MIN(BLOCKSZ - blockOffset, length - bytesRead);
+        int ext = fileBlock / FBLOCKS;
+        if (ext < m->nExt && m->zLen[ext]) {                // compressed: the rest of the extent
+            n = MIN(EXTSZ - (offset + bytesRead) % EXTSZ, length - bytesRead);
+            if (extentRead(fs, m, ext, data + bytesRead, (offset + bytesRead) % EXTSZ, n) == -1)
+                break;
+            bytesRead += n;
+            continue;
+        }
+        int b = fileBlock < m->nExt * FBLOCKS ? m->blocks[fileBlock] : 0;
+        if (b == 0)                                         // BLOCK NON EXISTENT: A HOLE
+            memset(data + bytesRead, 0, n);
+        else if (n < BLOCKSZ && blockCopy(fs, b, data + bytesRead, blockOffset, n))
+            ;                                               // no copy to a block buffer
+        else if (n < BLOCKSZ) {
+            cacheRead(fs, b, block.data);
+            memcpy(data + bytesRead, block.data + blockOffset, n);
+        } else if (!cacheLookup(fs, b, data + bytesRead)) {
+            vec[nvec].block = b;
+            vec[nvec++].buf = data + bytesRead;
+            if (nvec == VECMAX) {
+                blockIOv(fs, vec, nvec, FALSE);
+                nvec = 0;
+            }
+        }
+        bytesRead += n;
+    }
+    blockIOv(fs, vec, nvec, FALSE);
+    if (fs->cacheSlots != NULL)
+        readAhead(fs, m, offset, offset + bytesRead, size);
+    return bytesRead;
+}
+
+int fsRead(struct fs_ctx *fs, char *name, char *data, int length, int offset) {
+
+    if (fs->superB.magic != FS_MAGIC) {
+        printf("disc not mounted\n");
+        return -1;
+    }
+    char fname[FNAMESZ];
+    strEncode(fname, name, FNAMESZ);
+
+    pthread_rwlock_rdlock(fileLock(fs, fname));             // readers of a file run in parallel
+    struct extMap *m = extMapGet(fs, fname);
+    int r = m != NULL ? fileRead(fs, m, data, length, offset) : -1; // -1: FILE DOES NOT EXIST
+    extMapPut(fs, m);
+    pthread_rwlock_unlock(fileLock(fs, fname));
+    return r;
+}
+
+int fs_ctx_read(struct fs_ctx *fs, char *name, char *data, int length, int offset) {
+    long long t0 = opBegin(fs, FS_OP_READ);
+    int r = fsRead(fs, name, data, length, offset);
+    opEnd(fs, FS_OP_READ, t0);
+    traceCall(fs, FS_OP_READ, t0, name, offset, length, -1, r);
+    return r;
+}
+
+int fs_read(char *name, char *data, int length, int offset) {
+    return fs_ctx_read(defaultCtx(), name, data, length, offset);
+}
+
+/****************************************************************/
+
+/**
+ * set the size of the file whose extent map is m: with FS_F_SIZE32 only its
+ * TFILE dirent changes, else the new .ex/.ss go to the TFILE dirent and .ss
+ * to every extent (as all extents keep the last extent size)
+ */
+void setFileSize(struct fs_ctx *fs, struct extMap *m, int size) {
+    struct fs_dirent entry;
+
+    if (fs->fsFeatures & FS_F_SIZE32) {
+        entry = fs->dirCache[m->dirIdx[0]];
+        entry.size = (uint32_t) size;
+        writeFileEntry(fs, m->dirIdx[0], entry);
+        return;
+    }
+    int ex = size > 0 ? (size - 1) / (FBLOCKS * BLOCKSZ) : 0;
+    int ss = size - ex * FBLOCKS * BLOCKSZ;
+
+    for (int e = 0; e < m->nExt; e++) {
+        int idx = m->dirIdx[e];
+        if (idx == -1 || (fs->dirCache[idx].ss == ss && (e > 0 || fs->dirCache[idx].ex == ex)))
+            continue;
+        entry = fs->dirCache[idx];
+        entry.ss = (uint16_t) ss;
+        if (e == 0)
+            entry.ex = (uint16_t) ex;
+        writeFileEntry(fs, idx, entry);
+    }
+}
+
+/**
+ * write dirent of extent ext (of file with map m), adding it to the
+ * directory if it is a new extent. If that fails its blocks are freed.
+ * return: 0 if ok, -1 if no space in directory
+ */
+int writeExtent(struct fs_ctx *fs, struct extMap *m, int ext, struct fs_dirent *entry) {
+    int idx = ext < m->nExt ? m->dirIdx[ext] : -1;
+
+    if (writeFileEntry(fs, idx, *entry) == -1) {
+        freeBlockList(fs, entry->blocks, BLOCKPTRS(entry));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * create file fname (FS encoded) with size 0: a TINLINE dirent (no blocks)
+ * with FS_F_SIZE32, else a TFILE that, if withBlock, gets one data block,
+ * zeroed (it is read if the file grows past it, leaving a hole)
+ * return: extent map of the new file or NULL if no space
+ */
+struct extMap *createFile(struct fs_ctx *fs, char *fname, int withBlock) {
+    struct fs_dirent entry;
+    union fs_block block;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.st = fs->fsFeatures & FS_F_SIZE32 ? TINLINE : TFILE;
+    memcpy(entry.name, fname, FNAMESZ);
+    if (withBlock && entry.st == TFILE) {
+        int bNumber = allocBlock(fs);
+        if (bNumber == -1)
+            return NULL;
+        memset(block.data, 0, BLOCKSZ);
+        cacheWrite(fs, bNumber, block.data);
+        entry.blocks[0] = (uint32_t) bNumber;
+    }
+    if (writeFileEntry(fs, -1, entry) == -1) {
+        if (entry.blocks[0])
+            freeBlock(fs, entry.blocks[0]);
+        return NULL;
+    }
+    return extMapGet(fs, fname);
+}
+
+/**
+ * write length bytes of data (zeros if data==NULL) at offset of the tiny
+ * file with map m, in its TINLINE dirent (offset + length <= INLINESZ)
+ * return: number of bytes written
+ */
+int inlineWrite(struct fs_ctx *fs, struct extMap *m, char *data, int length, int offset) {
+    struct fs_dirent entry = fs->dirCache[m->dirIdx[0]];
+
+    if (data != NULL)
+        memcpy((char *) entry.blocks + offset, data, length);
+    else
+        memset((char *) entry.blocks + offset, 0, length);
+    if (offset + length > (int) entry.size)
+        entry.size = (uint32_t) (offset + length);
+    writeFileEntry(fs, m->dirIdx[0], entry);
+    return length;
+}
+
+/**
+ * make the tiny file with map m a TFILE, its data (if any) moved from the
+ * dirent to a new block (written before the dirent changes)
+ * return: 0 if ok, -1 if no disk space
+ */
+int inlineToBlocks(struct fs_ctx *fs, struct extMap *m) {
+    struct fs_dirent entry = fs->dirCache[m->dirIdx[0]];
+    union fs_block block;
+    int b = 0;
+
+    if (entry.size > 0) {
+        if ((b = allocBlock(fs)) == -1)
+            return -1;
+        memset(block.data, 0, BLOCKSZ);
+        memcpy(block.data, entry.blocks, entry.size);
+        cacheWrite(fs, b, block.data);
+    }
+    entry.st = TFILE;
+    memset(entry.blocks, 0, sizeof(entry.blocks));
+    entry.blocks[0] = (uint32_t) b;
+    writeFileEntry(fs, m->dirIdx[0], entry);
+    return 0;
+}
+
+/**
+ * write length bytes of data (zeros if data==NULL) at offset of the file
+ * with map m, in plain (not compressed) extents. Missing blocks, and copies
+ * of the shared blocks written (dropped by the file once its dirent points
+ * to the copy), are allocated in contiguous runs, placed right after the
+ * preceding block of the file when possible.
+ * return: number of bytes written
+ */
+int blocksWrite(struct fs_ctx *fs, struct extMap *m, char *data, int length, int offset) {
     union fs_block block;
-    memset(block.data, FREE, BLOCKSZ);
-    struct fs_dirent entry = block.dirent[0];
-    struct fs_dirent firstFileEntry = entry;
-    int numberOfBlocksWritten = 0;
-    int blockNumber = 0;
-    int firstEntryIdx = readFileEntry(fname, 0, &firstFileEntry);
-    int idxEntry = firstEntryIdx;                                                     // index da entrada a ser escrita
-    if(length == 0) {
-        if(idxEntry == -1) {
-            int bNumber = allocBlock();
-            if(bNumber == -1)
-                return 0;
-            entry.st = TFILE;
-            entry.ex = 0;
-            for (int i = 0; i < FNAMESZ; i++)
-                entry.name[i] = fname[i];
-            entry.ss = 0;
-            entry.blocks[0] = (uint16_t) bNumber;
-            if(writeFileEntry(idxEntry, entry) == -1)
-                freeBlock(bNumber);
+    struct fs_dirent entry;
+    int lastBlock = (offset + length - 1) / BLOCKSZ;
+    int bytesWritten = 0;
+    int curExt = -1;                                        // extent being updated in 'entry'
+    int curDirty = FALSE;
+    uint32_t copied[FBLOCKS];                               // shared blocks it no longer points to
+    int nCopied = 0;
+    int runNext = 0, runLeft = 0;                           // allocated, still unused, blocks
+    struct blockVec vec[VECMAX];                            // whole blocks written straight from data
+    int nvec = 0;
+    while (bytesWritten < length) {
+        int fileBlock = (offset + bytesWritten) / BLOCKSZ;
+        int blockOffset = (offset + bytesWritten) % BLOCKSZ;
+        int n = MIN(BLOCKSZ - blockOffset, length - bytesWritten);
+        int ext = fileBlock / FBLOCKS;
+
+        if (ext != curExt) {                                // moving to another extent
+            if (curDirty && writeExtent(fs, m, curExt, &entry) == -1) {
+                curDirty = FALSE;                           // (its blocks are freed already)
+                bytesWritten = curExt * FBLOCKS * BLOCKSZ - offset;
+                break;                                      // lost the new extent
+            }
+            freeBlockList(fs, copied, nCopied);
+            nCopied = 0;
+            curDirty = FALSE;
+            curExt = ext;
+            if (ext < m->nExt && m->dirIdx[ext] != -1)
+                entry = fs->dirCache[m->dirIdx[ext]];
+            else {                                          // new extent
+                memset(&entry, 0, sizeof(entry));
+                entry.st = TEXT;
+                memcpy(entry.name, m->name, FNAMESZ);
+                if (fs->fsFeatures & FS_F_EXT32)
+                    entry.ext = (uint32_t) ext;
+                else
+                    entry.ex = (uint16_t) ext;
+                if (!(fs->fsFeatures & FS_F_SIZE32))
+                    entry.ss = fs->dirCache[m->dirIdx[0]].ss;
+            }
+        }
+
+        int blockNumber = entry.blocks[fileBlock % FBLOCKS];
+        int shared = blockNumber != 0 && blockShared(fs, blockNumber);
+        if (blockNumber == 0 || shared) {                   // new block (or a copy of a shared one)
+            if (runLeft == 0) {                             // get a run for all missing blocks
+                int need = 0;
+                for (int fb = fileBlock; fb <= lastBlock; fb++)
+                    if (fb >= m->nExt * FBLOCKS || m->blocks[fb] == 0 || blockShared(fs, m->blocks[fb]))
+                        need++;
+                int prev = 0;
+                if (fileBlock % FBLOCKS)
+                    prev = entry.blocks[fileBlock % FBLOCKS - 1];
+                else if (fileBlock > 0 && fileBlock - 1 < m->nExt * FBLOCKS)
+                    prev = m->blocks[fileBlock - 1];
+                if ((runNext = allocRun(fs, prev ? prev + 1 : 0, need, &runLeft)) == -1)
+                    break;                                  // NO MORE DISK SPACE
+            }
+            if (shared && n < BLOCKSZ)                      // (the rest of the copy from it)
+                cacheRead(fs, blockNumber, block.data);
+            else if (n < BLOCKSZ)
+                memset(block.data, 0, BLOCKSZ);
+            if (shared)
+                copied[nCopied++] = (uint32_t) blockNumber;
+            blockNumber = runNext++;
+            runLeft--;
+            entry.blocks[fileBlock % FBLOCKS] = (uint32_t) blockNumber;
+            curDirty = TRUE;
+        } else if (n < BLOCKSZ)                             // partial block: read-modify-write
+            cacheRead(fs, blockNumber, block.data);
+
+        if (n == BLOCKSZ) {                                 // whole block: no read, no copy
+            char *buf = data != NULL ? data + bytesWritten : (char *) zeroBlock;
+            if (!cacheUpdate(fs, blockNumber, buf)) {
+                vec[nvec].block = blockNumber;
+                vec[nvec++].buf = buf;
+                if (nvec == VECMAX) {
+                    blockIOv(fs, vec, nvec, TRUE);
+                    nvec = 0;
+                }
+            }
+        } else {
+            if (data != NULL)
+                memcpy(block.data + blockOffset, data + bytesWritten, n);
+            else
+                memset(block.data + blockOffset, 0, n);
+            cacheWrite(fs, blockNumber, block.data);
+        }
+        bytesWritten += n;
+    }
+    blockIOv(fs, vec, nvec, TRUE);
+    if (curDirty && writeExtent(fs, m, curExt, &entry) == -1) // lost the new extent
+        bytesWritten = curExt * FBLOCKS * BLOCKSZ - offset;
+    else
+        freeBlockList(fs, copied, nCopied);
+    if (bytesWritten < 0)
+        bytesWritten = 0;
+    while (runLeft-- > 0)
+        freeBlock(fs, runNext++);
+    return bytesWritten;
+}
+
+/**
+ * write n bytes of data (zeros if data==NULL) at offset off of extent ext
+ * of the file with map m by storing the whole extent again (see
+ * extentStore): how compressed extents are written, and with n = 0 how a
+ * plain one is compressed
+ * return: as extentStore, or -1 if corrupt
+ */
+int extentWrite(struct fs_ctx *fs, struct extMap *m, int ext, char *data, int off, int n) {
+    char buf[MAXEXTSZ];
+
+    if (extentLoad(fs, m, ext, buf) == -1)
+        return -1;
+    if (data != NULL)
+        memcpy(buf + off, data, n);
+    else
+        memset(buf + off, 0, n);
+    return extentStore(fs, m, ext, buf);
+}
+
+/**
+ * write length bytes of data (zeros if data==NULL) at offset of the file
+ * with map m. Writing past the end leaves a hole (blocks not written stay
+ * unallocated). With compression on, the extents of data written that
+ * are then full (not the file's last partial one) are compressed.
+ * return: number of bytes written, -1 if the file would be too large
+ */
+int fileWrite(struct fs_ctx *fs, struct extMap *m, char *data, int length, int offset) {
+    int size = fileSize(fs, &fs->dirCache[m->dirIdx[0]]);
+    if (length <= 0)
+        return 0;
+    if (offset > maxFileSize(fs) - length)
+        return -1;                                          // FILE TOO LARGE
+    if (fs->dirCache[m->dirIdx[0]].st == TINLINE) {         // tiny file: stays in its dirent if it fits
+        if (offset + length <= INLINESZ)
+            return inlineWrite(fs, m, data, length, offset);
+        if (inlineToBlocks(fs, m) == -1)
+            return 0;                                       // NO MORE DISK SPACE
+    }
+
+    int zip = fs->compress && data != NULL;                 // (not for fs_fallocate's zeros)
+    int bytesWritten = 0;
+    while (bytesWritten < length) {
+        int pos = offset + bytesWritten, ext = pos / EXTSZ, r = 1;
+        int n = MIN(EXTSZ - pos % EXTSZ, length - bytesWritten);
+        char *src = data != NULL ? data + bytesWritten : NULL;
+        if (ext < m->nExt && m->zLen[ext])                  // compressed extent: store it again
+            r = extentWrite(fs, m, ext, src, pos % EXTSZ, n);
+        else if (zip && n == EXTSZ)                         // whole extent: compressed if it pays
+            r = extentStore(fs, m, ext, src);
+        if (r == -1)
+            break;
+        if (r == 1) {                                       // plain: up to an extent that may not be
+            int e = ext + 1;
+            while (!zip && e * EXTSZ < offset + length && (e >= m->nExt || m->zLen[e] == 0))
+                e++;
+            n = MIN(e * EXTSZ - pos, length - bytesWritten);
+            int w = blocksWrite(fs, m, src, n, pos);
+            if (w < n) {
+                bytesWritten += w;
+                break;
+            }
         }
+        bytesWritten += n;
+    }
+
+    int end = offset + bytesWritten > size ? offset + bytesWritten : size;
+    for (int e = offset / EXTSZ; zip && e * EXTSZ < offset + bytesWritten; e++)
+        if ((e * EXTSZ < offset || (e + 1) * EXTSZ > offset + bytesWritten) && // (else done above)
+            (e + 1) * EXTSZ <= end && e < m->nExt && m->dirIdx[e] != -1 && m->zLen[e] == 0)
+            extentWrite(fs, m, e, NULL, 0, 0);              // now full: compress it
+    if (bytesWritten > 0 && offset + bytesWritten > size)
+        setFileSize(fs, m, offset + bytesWritten);
+    return bytesWritten;
+}
+
+int fsWrite(struct fs_ctx *fs, char *name, char *data, int length, int offset) { // length max value is 8KB, Offset past the end leaves a hole
+
+    if (fs->superB.magic != FS_MAGIC) {
+        printf("disc not mounted\n");
+        return -1;
+    }
+    char fname[FNAMESZ];
+    strEncode(fname, name, FNAMESZ);
+
+    pthread_rwlock_wrlock(fileLock(fs, fname));
+    struct extMap *m = extMapGet(fs, fname);
+    int r = 0;
+    if (m != NULL || (m = createFile(fs, fname, length == 0)) != NULL) // FILE NOT FOUND: create it
+        r = fileWrite(fs, m, data, length, offset);         // (without FS_F_SIZE32 an empty file gets one block)
+    extMapPut(fs, m);
+    pthread_rwlock_unlock(fileLock(fs, fname));
+    return r;
+}
+
+int fs_ctx_write(struct fs_ctx *fs, char *name, char *data, int length, int offset) {
+    long long t0 = opBegin(fs, FS_OP_WRITE);
+    int r = fsWrite(fs, name, data, length, offset);
+    opEnd(fs, FS_OP_WRITE, t0);
+    traceCall(fs, FS_OP_WRITE, t0, name, offset, length, -1, r);
+    return r;
+}
+
+int fs_write(char *name, char *data, int length, int offset) {
+    return fs_ctx_write(defaultCtx(), name, data, length, offset);
+}
+
+/****************************************************************/
+
+/**
+ * make the file at least size bytes long (zero filled), allocating all its
+ * blocks now, in as few contiguous runs as possible, so later writes up to
+ * size need no allocation (a tiny file keeps its data in its dirent). The
+ * file is created if needed.
+ * return: 0 if ok, -1 if error (not mounted or no space)
+ */
+int fsFallocate(struct fs_ctx *fs, char *name, int size) {
+
+    if (fs->superB.magic != FS_MAGIC) {
+        printf("disc not mounted\n");
+        return -1;
+    }
+    char fname[FNAMESZ];
+    strEncode(fname, name, FNAMESZ);
+
+    pthread_rwlock_wrlock(fileLock(fs, fname));
+    struct extMap *m = extMapGet(fs, fname);
+    int r = -1;
+    if (m != NULL || (m = createFile(fs, fname, FALSE)) != NULL) {
+        int cur = fileSize(fs, &fs->dirCache[m->dirIdx[0]]);
+        r = size <= cur || fileWrite(fs, m, NULL, size - cur, cur) == size - cur ? 0 : -1;
+    }
+    extMapPut(fs, m);
+    pthread_rwlock_unlock(fileLock(fs, fname));
+    return r;
+}
+
+int fs_ctx_fallocate(struct fs_ctx *fs, char *name, int size) {
+    long long t0 = opBegin(fs, FS_OP_FALLOCATE);
+    int r = fsFallocate(fs, name, size);
+    opEnd(fs, FS_OP_FALLOCATE, t0);
+    traceCall(fs, FS_OP_FALLOCATE, t0, name, 0, size, -1, r);
+    return r;
+}
+
+int fs_fallocate(char *name, int size) {
+    return fs_ctx_fallocate(defaultCtx(), name, size);
+}
+
+/****************************************************************/
+
+/**
+ * set the size of the file with map m to size bytes. Growing it leaves a
+ * hole (no blocks are allocated); shrinking it frees the blocks and extents
+ * past size and zeroes the rest of its (new) last block, so a later hole
+ * there reads as zeros (a compressed last extent is stored again).
+ * return: 0 if ok, -1 if no disk space
+ */
+int fileTruncate(struct fs_ctx *fs, struct extMap *m, int size) {
+    struct fs_dirent entry = fs->dirCache[m->dirIdx[0]];
+    int cur = fileSize(fs, &entry);
+
+    if (entry.st == TINLINE && size <= INLINESZ) {          // tiny file: all in its dirent
+        if (size < cur)
+            memset((char *) entry.blocks + size, 0, cur - size);
+        entry.size = (uint32_t) size;
+        writeFileEntry(fs, m->dirIdx[0], entry);
         return 0;
-    }                                                                                // Sneaky length is sneaky
-    if (idxEntry == -1) {                                                                               // ENTRY NOT FOUND <=> FILE NOT FOUND
-        entry.st = TFILE;
-        entry.ex = 0;
-        for (int i = 0; i < FNAMESZ; i++)
-            entry.name[i] = fname[i];
-        entry.ss = (uint16_t) length;
-        blockNumber = allocBlock();
-        while(bytesWritten<length){
-            if (blockNumber == -1)     // NO MORE DISK SPACE
-                break;
-            while(currentBlockOffset<BLOCKSZ && bytesWritten<length)
-                block.data[currentBlockOffset++] = data[bytesWritten++];
-            entry.blocks[numberOfBlocksWritten++] = (uint16_t) blockNumber;
-            disk_write((unsigned int) blockNumber, block.data);
-            if(currentBlockOffset == BLOCKSZ) {
-                currentBlockOffset = 0;
-                blockNumber = allocBlock();
-                memset(block.data,FREE,sizeof(block.data));
+    }
+    if (entry.st == TINLINE && inlineToBlocks(fs, m) == -1)
+        return -1;
+
+    int ze = size / EXTSZ;                                  // (cut by the new end)
+    if (size < cur && size % EXTSZ && ze < m->nExt && m->zLen[ze] &&
+        extentWrite(fs, m, ze, NULL, size % EXTSZ, EXTSZ - size % EXTSZ) == -1)
+        return -1;
+    if (size < cur) {
+        int keep = (size + BLOCKSZ - 1) / BLOCKSZ;          // file blocks kept
+        int last = keep > 0 && keep <= m->nExt * FBLOCKS && !m->zLen[(keep - 1) / FBLOCKS] ?
+                   m->blocks[keep - 1] : 0;
+        int tail = BLOCKSZ - size % BLOCKSZ;
+        if (last != 0 && size % BLOCKSZ && blocksWrite(fs, m, NULL, tail, size) < tail)
+            return -1;                                      // (a shared block is copied)
+        for (int e = keep / FBLOCKS; e < m->nExt; e++) {
+            int idx = m->dirIdx[e];
+            if (idx == -1)
+                continue;
+            uint32_t freed[FBLOCKS];
+            int nfreed = 0;
+            entry = fs->dirCache[idx];
+            int zip = ISZIP(&entry);                        // (compressed: all its blocks or none)
+            for (int i = 0; i < BLOCKPTRS(&entry); i++)
+                if ((zip ? e * FBLOCKS : e * FBLOCKS + i) >= keep && entry.blocks[i]) {
+                    freed[nfreed++] = entry.blocks[i];
+                    entry.blocks[i] = 0;
+                }
+            if (e > 0 && e * FBLOCKS >= keep)               // extent past the end: remove it
+                memset(&entry, 0, sizeof(entry));
+            else if (zip && e * FBLOCKS >= keep) {          // compressed 1st extent: now empty
+                entry.st = TFILE;
+                ZLEN(&entry) = 0;
+            } else if (nfreed == 0)
+                continue;
+            writeFileEntry(fs, idx, entry);                 // (no longer points to them)
+            for (int i = 0; i < nfreed; i++)
+                freeBlock(fs, freed[i]);
+        }
+    }
+    if (size != cur)
+        setFileSize(fs, m, size);
+    return 0;
+}
+
+/**
+ * set the size of file name to size bytes (see fileTruncate)
+ * return: 0 if ok, -1 if error (not mounted, no such file or no space)
+ */
+int fsTruncate(struct fs_ctx *fs, char *name, int size) {
+
+    if (fs->superB.magic != FS_MAGIC) {
+        printf("disc not mounted\n");
+        return -1;
+    }
+    if (size < 0 || size > maxFileSize(fs))
+        return -1;
+    char fname[FNAMESZ];
+    strEncode(fname, name, FNAMESZ);
+
+    pthread_rwlock_wrlock(fileLock(fs, fname));
+    struct extMap *m = extMapGet(fs, fname);
+    int r = m != NULL ? fileTruncate(fs, m, size) : -1;     // -1: FILE DOES NOT EXIST
+    extMapPut(fs, m);
+    pthread_rwlock_unlock(fileLock(fs, fname));
+    return r;
+}
+
+int fs_ctx_truncate(struct fs_ctx *fs, char *name, int size) {
+    long long t0 = opBegin(fs, FS_OP_TRUNCATE);
+    int r = fsTruncate(fs, name, size);
+    opEnd(fs, FS_OP_TRUNCATE, t0);
+    traceCall(fs, FS_OP_TRUNCATE, t0, name, 0, size, -1, r);
+    return r;
+}
+
+int fs_truncate(char *name, int size) {
+    return fs_ctx_truncate(defaultCtx(), name, size);
+}
+
+/****************************************************************/
+
+/**
+ * add the dirents of a clone named dname (FS encoded, its lock held) of the
+ * file with map m: copies of the file's dirents pointing to the same blocks,
+ * each block getting one more reference (at most one per dirent, so the
+ * 32 bit counts fit even with 1M dirents). The extents go first and the first dirent last, so the clone
+ * only shows up whole. No data block is read or written.
+ * return: 0 if ok, -1 if no space in the directory or no memory (nothing
+ * is added)
+ */
+int fileClone(struct fs_ctx *fs, struct extMap *m, char *dname) {
+    int *idx = malloc(m->nExt * sizeof(int));
+    int nIdx = 0, r = 0;
+
+    if (idx == NULL)
+        return -1;
+    pthread_mutex_lock(&fs->allocLock);
+    if (blockRefsAlloc(fs) == -1) {
+        pthread_mutex_unlock(&fs->allocLock);
+        free(idx);
+        return -1;
+    }
+    for (int i = 0; i < m->nExt * FBLOCKS; i++)             // (zero: a hole, or a tiny file)
+        if (m->blocks[i] != 0)
+            __atomic_fetch_add(&fs->blockRefs[m->blocks[i]], 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&fs->allocLock);
+    for (int e = m->nExt - 1; e >= 0 && r == 0; e--) {
+        if (m->dirIdx[e] == -1)                             // (a sparse file may miss extents)
+            continue;
+        struct fs_dirent entry = fs->dirCache[m->dirIdx[e]];
+        memcpy(entry.name, dname, FNAMESZ);
+        if ((idx[nIdx] = writeFileEntry(fs, -1, entry)) == -1)
+            r = -1;                                         // directory is full
+        else
+            nIdx++;
+    }
+    if (r == -1) {
+        dirRemove(fs, idx, nIdx);
+        freeBlockList(fs, m->blocks, m->nExt * FBLOCKS);    // (drops the references taken)
+    }
+    free(idx);
+    return r;
+}
+
+/**
+ * create file dst as a clone of file src (see fileClone): it shares all of
+ * src's data blocks, and a later write to either file copies the shared
+ * blocks it changes
+ * return: 0 if ok, -1 if error (not mounted, src does not exist, dst
+ * exists or no space in the directory)
+ */
+int fsClone(struct fs_ctx *fs, char *src, char *dst) {
+
+    if (fs->superB.magic != FS_MAGIC) {
+        printf("disc not mounted\n");
+        return -1;
+    }
+    char sname[FNAMESZ], dname[FNAMESZ];
+    strEncode(sname, src, FNAMESZ);
+    strEncode(dname, dst, FNAMESZ);
+    if (memcmp(sname, dname, FNAMESZ) == 0)
+        return -1;
+
+    pthread_rwlock_t *first = fileLock(fs, sname), *second = fileLock(fs, dname);
+    if (second < first) {                                   // stripes in increasing order
+        first = second;
+        second = fileLock(fs, sname);
+    }
+    pthread_rwlock_wrlock(first);
+    if (second != first)
+        pthread_rwlock_wrlock(second);
+    struct extMap *m = extMapGet(fs, sname);
+    int r = -1;
+    if (m != NULL && readFileEntry(fs, dname, 0, NULL) == -1)
+        r = fileClone(fs, m, dname);
+    extMapPut(fs, m);
+    if (second != first)
+        pthread_rwlock_unlock(second);
+    pthread_rwlock_unlock(first);
+    return r;
+}
+
+int fs_ctx_clone(struct fs_ctx *fs, char *src, char *dst) {
+    long long t0 = opBegin(fs, FS_OP_CLONE);
+    int r = fsClone(fs, src, dst);
+    opEnd(fs, FS_OP_CLONE, t0);
+    traceRecord(fs, FS_OP_CLONE, t0, src, dst, 0, 0, -1, r);
+    return r;
+}
+
+int fs_clone(char *src, char *dst) {
+    return fs_ctx_clone(defaultCtx(), src, dst);
+}
+
+/****************************************************************/
+
+/**
+ * measure the fragmentation of files and directory (see struct fs_frag)
+ */
+void fragMeasure(struct fs_ctx *fs, struct fs_frag *frag) {
+    int withBlocks = 0, live = 0;
+
+    memset(frag, 0, sizeof(*frag));
+    pthread_rwlock_rdlock(&fs->dirLock);
+    for (int i = 0; i < fs->dirBlocks * DIRENTS_PER_BLOCK; i++) {
+        struct fs_dirent *first = &fs->dirCache[i];
+        live += first->st != TEMPTY;
+        if (!ISFILE(first))
+            continue;
+        frag->files++;
+        int prev = 0, blocks = frag->blocks;
+        for (int e = 0; e < fileExtents(fs, first) && first->st != TINLINE; e++) {
+            int idx = e == 0 ? i : dirLookup(fs, first->name, (uint32_t) e);
+            for (int k = 0; idx != -1 && k < BLOCKPTRS(&fs->dirCache[idx]); k++) {
+                int b = fs->dirCache[idx].blocks[k];
+                if (b == 0)                                 // (holes don't break runs)
+                    continue;
+                frag->blocks++;
+                frag->runs += b != prev + 1;
+                prev = b;
             }
         }
-        if(blockNumber == -1){
-            entry.ss = (uint16_t) bytesWritten;
+        withBlocks += frag->blocks > blocks;
+    }
+    frag->dirBlocks = fs->dirBlocks;
+    pthread_rwlock_unlock(&fs->dirLock);
+    frag->dirBlocksMin = live > 0 ? (live - 1) / DIRENTS_PER_BLOCK + 1 : 1;
+    if (frag->blocks > withBlocks)
+        frag->score = 100.0 * (frag->runs - withBlocks) / (frag->blocks - withBlocks);
+}
+
+/**
+ * move the data blocks of file fname (FS encoded) to as few contiguous runs
+ * as possible, in file order (holes stay holes). The data is copied before
+ * the dirents point to the new blocks, and the old blocks are freed after.
+ * Nothing is moved if that would not lower its number of runs, nor if the
+ * file shares blocks with clones (moving them would unshare them).
+ * return: 1 if moved, 0 if not
+ */
+int fileDefrag(struct fs_ctx *fs, char *fname) {
+    int moved = 0;
+
+    pthread_rwlock_wrlock(fileLock(fs, fname));
+    struct extMap *m = extMapGet(fs, fname);
+    int n = 0, runs = 0, prev = 0, shared = FALSE;
+    for (int i = 0; m != NULL && i < m->nExt * FBLOCKS; i++)
+        if (m->blocks[i] != 0) {
+            n++;
+            runs += (int) m->blocks[i] != prev + 1;
+            prev = (int) m->blocks[i];
+            shared |= blockShared(fs, m->blocks[i]);
         }
-        if(writeFileEntry(idxEntry,entry) == -1) {
-            for (int i = 0; i < FBLOCKS; i++) {
-                freeBlock(entry.blocks[i]);
-                entry.blocks[i] = FREE;
+    uint32_t *oldB = runs > 1 && !shared ? malloc(n * sizeof(uint32_t)) : NULL;
+    uint32_t *newB = runs > 1 && !shared ? malloc(n * sizeof(uint32_t)) : NULL;
+    int got = 0, newRuns = 0;
+    while (oldB != NULL && newB != NULL && got < n && newRuns < runs) {
+        int count, b = allocRun(fs, got > 0 ? newB[got - 1] + 1 : 0, n - got, &count);
+        if (b == -1)
+            break;                                          // NO MORE DISK SPACE
+        newRuns += got == 0 || (uint32_t) b != newB[got - 1] + 1;
+        for (int i = 0; i < count; i++)
+            newB[got++] = (uint32_t) (b + i);
+    }
+    if (got == n && newRuns < runs) {
+        union fs_block block;
+        n = 0;
+        for (int i = 0; i < m->nExt * FBLOCKS; i++)         // copy the data
+            if (m->blocks[i] != 0) {
+                oldB[n] = m->blocks[i];
+                cacheRead(fs, oldB[n], block.data);
+                cacheWrite(fs, newB[n++], block.data);
             }
-            return 0;
+        n = 0;
+        for (int e = 0; e < m->nExt; e++) {                 // point the dirents to them
+            if (m->dirIdx[e] == -1)
+                continue;
+            struct fs_dirent entry = fs->dirCache[m->dirIdx[e]];
+            for (int k = 0; k < BLOCKPTRS(&entry); k++)
+                if (entry.blocks[k] != 0)
+                    entry.blocks[k] = newB[n++];
+            writeFileEntry(fs, m->dirIdx[e], entry);
         }
-        return bytesWritten;
-    } else {
-        // FILE EXISTS
-        idxEntry = readFileEntry(fname, (uint16_t) extent, &entry);
-        int fileSize = firstFileEntry.ex * FBLOCKS*BLOCKSZ + firstFileEntry.ss;
-        if(extent == 0)
-            entry.st = TFILE;
-        else
-            entry.st = TEXT;
-        if(idxEntry ==-1)
-            entry.ex = (uint16_t) extent;
-        for (int i = 0; i < FNAMESZ; i++)
-            entry.name[i] = fname[i];
-        blockNumber = entry.blocks[blockNumberEntry++];
-        while(bytesWritten<length){
-            if(blockNumber == 0){
-                blockNumber = allocBlock();
-                if(blockNumber != -1)
-                    entry.blocks[blockNumberEntry++] = (uint16_t) blockNumber;
-            }
-            if(blockNumber == -1)
-                break; // to be continued
-            disk_read((unsigned int) blockNumber, block.data);
-            while(currentBlockOffset<BLOCKSZ && bytesWritten<length)
-                block.data[currentBlockOffset++] = data[bytesWritten++];
-            disk_write((unsigned int) blockNumber, block.data);
-            if(currentBlockOffset == BLOCKSZ) {
-                currentBlockOffset = 0;
-                blockNumber = entry.blocks[blockNumberEntry];
-            }
-            if(blockNumberEntry == FBLOCKS && bytesWritten < length){
-                if(bytesWritten+offset > fileSize) {
-                    int futureSS = firstFileEntry.ss + bytesWritten + offset - fileSize;
-                    if(futureSS > FBLOCKS*BLOCKSZ)
-                        entry.ss = (uint16_t) (futureSS - FBLOCKS*BLOCKSZ);
-                    else
-                        entry.ss = (uint16_t) (futureSS);
-                }
-                int lastExtentSize = entry.ss;
-                if (writeFileEntry(idxEntry, entry) == -1) {
-                    for (int i = 0; i<FBLOCKS; i++) {
-                        freeBlock(entry.blocks[i]);
-                        entry.blocks[i] = FREE;
-                    }
-                    return 0;
-                }
-                int tempExtent = 0;
-                int tempIdx = readFileEntry(fname, (uint16_t) tempExtent, &entry);
-                while(tempIdx != idxEntry && tempIdx != -1 && tempExtent < extent) {
-                    entry.ss = (uint16_t) lastExtentSize;
-                    writeFileEntry(tempIdx,entry);
-                    tempIdx = readFileEntry(fname, (uint16_t) tempExtent++, &entry);
-                }
-                memset(&entry,FREE,sizeof(struct fs_dirent));
-                idxEntry = readFileEntry(fname, (uint16_t) ++extent, &entry);
-                if(idxEntry == -1) {
-                    firstFileEntry.ex = (uint16_t) extent;
-                    writeFileEntry(firstEntryIdx,firstFileEntry);
-                        entry.st = TEXT;
-                    entry.ex = (uint16_t) extent;
-                    for (int i = 0; i < FNAMESZ; i++)
-                        entry.name[i] = fname[i];
-                }
-                currentBlockOffset = 0;
-                blockNumberEntry = 0;
-                blockNumber = entry.blocks[blockNumberEntry];
-            }
+        freeBlockList(fs, oldB, n);
+        moved = 1;
+    } else if (newB != NULL)
+        freeBlockList(fs, newB, got);
+    free(oldB);
+    free(newB);
+    extMapPut(fs, m);
+    pthread_rwlock_unlock(fileLock(fs, fname));
+    return moved;
+}
+
+/**
+ * move the live dirents into the fewest directory blocks (to the lowest
+ * free dirent idxs) and free the emptied directory blocks (and indirect
+ * dir blocks). Dirents of any file may move, so all the file locks are
+ * taken (in order). A moved dirent is on disk in both places until the
+ * directory list drops the old blocks, so the disk is marked dirty first:
+ * a crash in between leaves copies that fsMount drops.
+ * return: number of (indirect) directory blocks freed
+ */
+int dirCompact(struct fs_ctx *fs) {
+    int live = 0, nfreed = 0;
+
+    for (int l = 0; l < FILELOCKS; l++)
+        pthread_rwlock_wrlock(&fs->fileLocks[l]);
+    pthread_rwlock_wrlock(&fs->dirLock);
+    for (int i = 0; i < fs->dirBlocks * DIRENTS_PER_BLOCK; i++)
+        live += fs->dirCache[i].st != TEMPTY;
+    int keep = live > 0 ? (live - 1) / DIRENTS_PER_BLOCK + 1 : 1;
+    uint32_t *freed = keep < fs->dirBlocks ?
+                      malloc((fs->dirBlocks + SB2INDIRECT) * sizeof(uint32_t)) : NULL;
+    char *touched = freed != NULL ? calloc(keep, 1) : NULL;
+    if (touched != NULL) {
+        pthread_mutex_lock(&fs->allocLock);                 // (the freed blocks change the bitmap)
+        bitMapChanged(fs);
+        pthread_mutex_unlock(&fs->allocLock);
+        pthread_mutex_lock(&fs->mapLock);
+        for (int from = keep * DIRENTS_PER_BLOCK, to = 0; from < fs->dirBlocks * DIRENTS_PER_BLOCK; from++) {
+            struct fs_dirent *d = &fs->dirCache[from];
+            if (d->st == TEMPTY)
+                continue;
+            while (fs->dirCache[to].st != TEMPTY)
+                to++;
+            dirIndexRemove(fs, from);
+            fs->dirCache[to] = *d;
+            memset(d, 0, sizeof(*d));
+            dirIndexAdd(fs, to);
+            touched[to / DIRENTS_PER_BLOCK] = TRUE;
+            struct extMap *m = extMapFind(fs, fs->dirCache[to].name);
+            int ext = ISEXT(&fs->dirCache[to]) ? (int) EXTID(&fs->dirCache[to]) : 0;
+            if (m != NULL && ext < m->nExt && m->dirIdx[ext] == from)
+                m->dirIdx[ext] = to;
         }
-        if(bytesWritten+offset > fileSize) {
-            int futureSS = firstFileEntry.ss + bytesWritten + offset - fileSize;
-            if(futureSS > FBLOCKS*BLOCKSZ)
-                entry.ss = (uint16_t) (futureSS - FBLOCKS*BLOCKSZ);
-            else
-                entry.ss = (uint16_t) futureSS;
+        pthread_mutex_unlock(&fs->mapLock);
+        for (int b = 0; b < keep; b++)                      // moved dirents on disk first
+            if (touched[b])
+                dirBlockWrite(fs, b);
+        pthread_mutex_lock(&fs->superLock);
+        for (int b = keep; b < fs->dirBlocks; b++) {
+            freed[nfreed++] = fs->dirList[b];
+            fs->dirList[b] = 0;
         }
-        int lastExtentSize = entry.ss;
-        if (writeFileEntry(idxEntry, entry) == -1) {
-            for (int i = 0; i< FBLOCKS; i++) {
-                freeBlock(entry.blocks[i]);
-                entry.blocks[i] = FREE;
-            }
-            return 0;  
+        for (int j = (keep - 1) / DIRLISTPB + 1;            // (indirect blocks left empty)
+             (fs->fsFeatures & FS_F_LARGE) && j <= (fs->dirBlocks - 1) / DIRLISTPB; j++) {
+            freed[nfreed++] = fs->dirIndirect[j];
+            fs->dirIndirect[j] = 0;
         }
-        int tempExtent = 0;
-        int tempIdx = readFileEntry(fname, (uint16_t) tempExtent, &entry);
-        while(tempIdx != idxEntry && tempIdx != -1 && tempExtent < extent) {
-            entry.ss = (uint16_t) lastExtentSize;
-            writeFileEntry(tempIdx,entry);
-            tempIdx = readFileEntry(fname, (uint16_t) tempExtent++, &entry);
+        pthread_mutex_unlock(&fs->superLock);
+        dirListWrite(fs, keep - 1);
+        dirCacheGrow(fs, keep);
+        fs->dirFree = 0;                                    // (holes may be left below keep)
+    }
+    pthread_rwlock_unlock(&fs->dirLock);
+    freeBlockList(fs, freed, nfreed);
+    free(freed);
+    free(touched);
+    for (int l = FILELOCKS - 1; l >= 0; l--)
+        pthread_rwlock_unlock(&fs->fileLocks[l]);
+    return nfreed;
+}
+
+/**
+ * defragment up to maxFiles files (all if maxFiles <= 0) going on from
+ * where the last call stopped; a pass over the whole directory ends by
+ * compacting it. before/after (if not NULL) get the fragmentation measured
+ * before and after the call.
+ * return: 1 if the pass goes on (call again), 0 if it ended, -1 if error
+ */
+int fsDefrag(struct fs_ctx *fs, int maxFiles, struct fs_frag *before, struct fs_frag *after) {
+
+    if (fs->superB.magic != FS_MAGIC) {
+        printf("disc not mounted\n");
+        return -1;
+    }
+    if (before != NULL)
+        fragMeasure(fs, before);
+    int r = 1;
+    for (int visited = 0; maxFiles <= 0 || visited < maxFiles; visited++) {
+        char fname[FNAMESZ];
+        int i;
+        pthread_rwlock_rdlock(&fs->dirLock);                // next file from the cursor
+        for (i = __atomic_load_n(&fs->defragNext, __ATOMIC_RELAXED); i < fs->dirBlocks * DIRENTS_PER_BLOCK; i++)
+            if (ISFILE(&fs->dirCache[i]) && fs->dirCache[i].st != TINLINE) { // (tiny files have no blocks)
+                memcpy(fname, fs->dirCache[i].name, FNAMESZ);
+                break;
+            }
+        int end = i >= fs->dirBlocks * DIRENTS_PER_BLOCK;
+        pthread_rwlock_unlock(&fs->dirLock);
+        if (end) {
+            dirCompact(fs);
+            __atomic_store_n(&fs->defragNext, 0, __ATOMIC_RELAXED);
+            r = 0;
+            break;
         }
-        return bytesWritten;
+        __atomic_store_n(&fs->defragNext, i + 1, __ATOMIC_RELAXED); // (racing calls may both do a file)
+        fileDefrag(fs, fname);
+    }
+    if (after != NULL)
+        fragMeasure(fs, after);
+    return r;
+}
+
+int fs_ctx_defrag(struct fs_ctx *fs, int maxFiles, struct fs_frag *before, struct fs_frag *after) {
+    long long t0 = opBegin(fs, FS_OP_DEFRAG);
+    int r = fsDefrag(fs, maxFiles, before, after);
+    opEnd(fs, FS_OP_DEFRAG, t0);
+    traceCall(fs, FS_OP_DEFRAG, t0, NULL, 0, maxFiles, -1, r);
+    return r;
+}
+
+int fs_defrag(int maxFiles, struct fs_frag *before, struct fs_frag *after) {
+    return fs_ctx_defrag(defaultCtx(), maxFiles, before, after);
+}
+
+/**
+ * measure the fragmentation of the mounted volume
+ * return: 0 if ok, -1 if not mounted
+ */
+int fs_ctx_frag(struct fs_ctx *fs, struct fs_frag *frag) {
+    if (fs->superB.magic != FS_MAGIC) {
+        printf("disc not mounted\n");
+        return -1;
+    }
+    fragMeasure(fs, frag);
+    return 0;
+}
+
+int fs_frag(struct fs_frag *frag) {
+    return fs_ctx_frag(defaultCtx(), frag);
+}
+
+/****************************************************************/
+
+/**
+ * open file name (created, empty, if create is TRUE and it does not exist),
+ * resolving it once: the handle keeps its extent map (first dirent idx,
+ * size and all its data blocks) for fs_pread/fs_pwrite
+ * return: file handle, or -1 if error
+ */
+int fsOpen(struct fs_ctx *fs, char *name, int create) {
+
+    if (fs->superB.magic != FS_MAGIC) {
+        printf("disc not mounted\n");
+        return -1;
+    }
+    char fname[FNAMESZ];
+    strEncode(fname, name, FNAMESZ);
+
+    int fd;
+    pthread_mutex_lock(&fs->mapLock);
+    for (fd = 0; fd < MAXOPEN && fs->openFiles[fd] != NULL; fd++)
+        ;
+    pthread_mutex_unlock(&fs->mapLock);
+    if (fd == MAXOPEN) {
+        printf("too many open files\n");
+        return -1;
+    }
+    pthread_rwlock_wrlock(fileLock(fs, fname));
+    struct extMap *m = extMapGet(fs, fname);                // pinned until fs_close
+    if (m == NULL && create)
+        m = createFile(fs, fname, TRUE);
+    pthread_rwlock_unlock(fileLock(fs, fname));
+    if (m == NULL)
+        return -1;
+    pthread_mutex_lock(&fs->mapLock);                       // (the free fd may be gone)
+    for (fd = 0; fd < MAXOPEN && fs->openFiles[fd] != NULL; fd++)
+        ;
+    if (fd < MAXOPEN)
+        fs->openFiles[fd] = m;
+    pthread_mutex_unlock(&fs->mapLock);
+    if (fd == MAXOPEN) {
+        printf("too many open files\n");
+        extMapPut(fs, m);
+        return -1;
+    }
+    return fd;
+}
+
+int fs_ctx_open(struct fs_ctx *fs, char *name, int create) {
+    long long t0 = opBegin(fs, FS_OP_OPEN);
+    int r = fsOpen(fs, name, create);
+    opEnd(fs, FS_OP_OPEN, t0);
+    traceCall(fs, FS_OP_OPEN, t0, name, 0, create, -1, r);
+    return r;
+}
+
+int fs_open(char *name, int create) {
+    return fs_ctx_open(defaultCtx(), name, create);
+}
+
+/**
+ * get the map of open file handle fd, pinned and with its file locked
+ * (for writing if write), until handlePut
+ * return: the map, or NULL if fd is not valid (or its file was deleted)
+ */
+struct extMap *handleGet(struct fs_ctx *fs, int fd, int write) {
+    struct extMap *m = NULL;
+
+    pthread_mutex_lock(&fs->mapLock);
+    if (fs->superB.magic == FS_MAGIC && fd >= 0 && fd < MAXOPEN && (m = fs->openFiles[fd]) != NULL)
+        m->refs++;
+    pthread_mutex_unlock(&fs->mapLock);
+    if (m == NULL)
+        return NULL;
+    if (write)
+        pthread_rwlock_wrlock(fileLock(fs, m->name));
+    else
+        pthread_rwlock_rdlock(fileLock(fs, m->name));
+    pthread_mutex_lock(&fs->mapLock);
+    int deleted = m->used == 0;
+    pthread_mutex_unlock(&fs->mapLock);
+    if (deleted) {
+        pthread_rwlock_unlock(fileLock(fs, m->name));
+        extMapPut(fs, m);
+        return NULL;
+    }
+    return m;
+}
+
+void handlePut(struct fs_ctx *fs, struct extMap *m) {
+    pthread_rwlock_unlock(fileLock(fs, m->name));
+    extMapPut(fs, m);
+}
+
+int fsPread(struct fs_ctx *fs, int fd, char *data, int length, int offset) {
+    struct extMap *m = handleGet(fs, fd, FALSE);
+
+    if (m == NULL)
+        return -1;
+    int r = fileRead(fs, m, data, length, offset);
+    handlePut(fs, m);
+    return r;
+}
+
+int fs_ctx_pread(struct fs_ctx *fs, int fd, char *data, int length, int offset) {
+    long long t0 = opBegin(fs, FS_OP_PREAD);
+    int r = fsPread(fs, fd, data, length, offset);
+    opEnd(fs, FS_OP_PREAD, t0);
+    traceCall(fs, FS_OP_PREAD, t0, NULL, offset, length, fd, r);
+    return r;
+}
+
+int fs_pread(int fd, char *data, int length, int offset) {
+    return fs_ctx_pread(defaultCtx(), fd, data, length, offset);
+}
+
+int fsPwrite(struct fs_ctx *fs, int fd, char *data, int length, int offset) {
+    struct extMap *m = handleGet(fs, fd, TRUE);
+
+    if (m == NULL)
+        return -1;
+    int r = fileWrite(fs, m, data, length, offset);
+    handlePut(fs, m);
+    return r;
+}
+
+int fs_ctx_pwrite(struct fs_ctx *fs, int fd, char *data, int length, int offset) {
+    long long t0 = opBegin(fs, FS_OP_PWRITE);
+    int r = fsPwrite(fs, fd, data, length, offset);
+    opEnd(fs, FS_OP_PWRITE, t0);
+    traceCall(fs, FS_OP_PWRITE, t0, NULL, offset, length, fd, r);
+    return r;
+}
+
+int fs_pwrite(int fd, char *data, int length, int offset) {
+    return fs_ctx_pwrite(defaultCtx(), fd, data, length, offset);
+}
+
+int fsClose(struct fs_ctx *fs, int fd) {
+    struct extMap *m = NULL;
+
+    pthread_mutex_lock(&fs->mapLock);
+    if (fs->superB.magic == FS_MAGIC && fd >= 0 && fd < MAXOPEN)
+        m = fs->openFiles[fd];
+    if (m != NULL)
+        fs->openFiles[fd] = NULL;
+    pthread_mutex_unlock(&fs->mapLock);
+    if (m == NULL)
+        return -1;
+    extMapPut(fs, m);
+    return 0;
+}
+
+int fs_ctx_close(struct fs_ctx *fs, int fd) {
+    long long t0 = opBegin(fs, FS_OP_CLOSE);
+    int r = fsClose(fs, fd);
+    opEnd(fs, FS_OP_CLOSE, t0);
+    traceCall(fs, FS_OP_CLOSE, t0, NULL, 0, 0, fd, r);
+    return r;
+}
+
+int fs_close(int fd) {
+    return fs_ctx_close(defaultCtx(), fd);
+}
+
+/****************************************************************/
+
+/**
+ * asynchronous fs_read/fs_write: see aioSubmit (data must stay valid until
+ * the request completes)
+ */
+int fs_ctx_read_async(struct fs_ctx *fs, char *name, char *data, int length, int offset,
+                      fs_aio_callback cb, void *arg) {
+    return aioSubmit(fs, FALSE, name, data, length, offset, cb, arg);
+}
+
+int fs_read_async(char *name, char *data, int length, int offset, fs_aio_callback cb, void *arg) {
+    return fs_ctx_read_async(defaultCtx(), name, data, length, offset, cb, arg);
+}
+
+int fs_ctx_write_async(struct fs_ctx *fs, char *name, char *data, int length, int offset,
+                       fs_aio_callback cb, void *arg) {
+    return aioSubmit(fs, TRUE, name, data, length, offset, cb, arg);
+}
+
+int fs_write_async(char *name, char *data, int length, int offset, fs_aio_callback cb, void *arg) {
+    return fs_ctx_write_async(defaultCtx(), name, data, length, offset, cb, arg);
+}
+
+int fs_ctx_aio_wait(struct fs_ctx *fs, int id, int *result) {
+    return aioReap(fs, id, result, TRUE);
+}
+
+int fs_aio_wait(int id, int *result) {
+    return fs_ctx_aio_wait(defaultCtx(), id, result);
+}
+
+int fs_ctx_aio_poll(struct fs_ctx *fs, int id, int *result) {
+    return aioReap(fs, id, result, FALSE);
+}
+
+int fs_aio_poll(int id, int *result) {
+    return fs_ctx_aio_poll(defaultCtx(), id, result);
+}
+
+/****************************************************************/
+
+void fs_ctx_stats(struct fs_ctx *fs, struct fs_stats *stats) {
+    statsLoad((unsigned long *) stats, (unsigned long *) &fs->fsStats,
+              offsetof(struct fs_stats, freeBlocks) / sizeof(unsigned long));
+    pthread_mutex_lock(&fs->allocLock);
+    stats->freeBlocks = fs->superB.magic == FS_MAGIC ? fs->freeBlocks : 0;
+    pthread_mutex_unlock(&fs->allocLock);
+}
+
+void fs_stats(struct fs_stats *stats) {
+    fs_ctx_stats(defaultCtx(), stats);
+}
+
+void fs_ctx_stats_reset(struct fs_ctx *fs) {
+    unsigned long *c = (unsigned long *) &fs->fsStats;
+
+    for (unsigned int i = 0; i < offsetof(struct fs_stats, freeBlocks) / sizeof(unsigned long); i++)
+        __atomic_store_n(&c[i], 0, __ATOMIC_RELAXED);
+}
+
+void fs_stats_reset() {
+    fs_ctx_stats_reset(defaultCtx());
+}
+
+/****************************************************************/
+
+/**
+ * start recording all public calls on fs to trace file filename: a
+ * struct fs_trace_hdr, then a struct fs_trace_rec per call as it ends
+ * return: 0 if ok, -1 if error (cannot create it, or already tracing)
+ */
+int fs_ctx_trace_start(struct fs_ctx *fs, const char *filename) {
+    struct fs_trace_hdr hdr = {FS_TRACE_MAGIC, sizeof(struct fs_trace_rec), 0, 0};
+
+    if (fs->traceFile != NULL) {
+        printf("already tracing\n");
+        return -1;
     }
-}
\ No newline at end of file
+    FILE *f = fopen(filename, "wb");
+    if (f == NULL)
+        return -1;
+    hdr.blocks = (uint32_t) fs->disk->size(fs->disk);
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1) {
+        fclose(f);
+        return -1;
+    }
+    fs->traceT0 = nowNs();
+    __atomic_store_n(&fs->traceFile, f, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int fs_trace_start(const char *filename) {
+    return fs_ctx_trace_start(defaultCtx(), filename);
+}
+
+/**
+ * stop recording (and close) the call trace of fs
+ * return: 0 if ok, -1 if not tracing or the trace could not be written
+ */
+int fs_ctx_trace_stop(struct fs_ctx *fs) {
+    pthread_mutex_lock(&fs->traceLock);
+    FILE *f = fs->traceFile;
+    __atomic_store_n(&fs->traceFile, NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&fs->traceLock);
+    return f != NULL && fclose(f) == 0 ? 0 : -1;
+}
+
+int fs_trace_stop() {
+    return fs_ctx_trace_stop(defaultCtx());
+}
@@ -0,0 +1,210 @@
+#ifndef FS_EXT_H
+#define FS_EXT_H
+
+#include <stdint.h>
+
+/*
+ * Extensions to the fs.h API, implemented in fs.c
+ */
+
+/* block cache */
+struct fs_cache_stats {
+    unsigned long hits;      // block requests served from the cache
+    unsigned long misses;    // block requests that went to the disk
+    unsigned long evictions; // blocks dropped to make room
+    unsigned long reads;     // physical disk_read/readv calls
+    unsigned long writes;    // physical disk_write/writev calls
+    unsigned long prefetched;   // blocks read ahead by fs_read
+    unsigned long prefetchHits; // read ahead blocks used later
+};
+
+int  fs_cache_config(int nblocks, int writeThrough);
+int  fs_readahead_config(int maxBlocks);
+void fs_cache_stats(struct fs_cache_stats *stats);
+int  fs_sync();
+int  fs_unmount();
+
+/* transparent compression: while on, each extent (8 blocks of a file) written
+ * in full is stored LZ compressed if that takes fewer blocks; reading any
+ * part of it decompresses it all. Returns the previous setting. */
+int  fs_compress_config(int on);
+
+/* disk format of fs_format: blockSize 0 (default) keeps the 16 bit format
+ * (1 KB blocks, up to 64K blocks and 504 directory blocks) for disks it
+ * can hold, larger disks get the large format with 4 KB blocks; else the
+ * large format with blockSize byte blocks (1, 2, 4 or 8 KB). The large
+ * format has 32 bit block numbers and a directory of up to 1M dirents, and
+ * its larger blocks mean 32 or 64 KB extents, so fewer dirents and disk
+ * transfers per byte. Both formats mount. Returns the previous value, -1
+ * if blockSize is not valid. */
+int  fs_format_config(int blockSize);
+
+/* preallocation and sparse files (holes read as zeros and take no blocks) */
+int  fs_fallocate(char *name, int size);
+int  fs_truncate(char *name, int size);
+
+/* defragmentation: fs_defrag moves up to maxFiles files (all if <= 0) to
+ * contiguous blocks, going on where the last call stopped, so a mounted
+ * volume can be defragmented a bit at a time; the end of each pass over
+ * the directory packs the dirents into the fewest directory blocks.
+ * before/after (if not NULL) get the fragmentation around the call.
+ * fs_defrag returns 1 if the pass goes on, 0 if it ended, -1 if error. */
+struct fs_frag {
+    int files;        // files on the volume
+    int blocks;       // their data blocks
+    int runs;         // runs of consecutive disk blocks holding them (in file order)
+    int dirBlocks;    // directory blocks
+    int dirBlocksMin; // fewest directory blocks holding all dirents
+    double score;     // % of consecutive file blocks not adjacent on disk (0 = none)
+};
+
+int  fs_frag(struct fs_frag *frag);
+int  fs_defrag(int maxFiles, struct fs_frag *before, struct fs_frag *after);
+
+/* file clones: fs_clone creates file dst sharing all the data blocks of
+ * file src, writing only dirents (an O(metadata) snapshot); a later write
+ * to either file copies the shared blocks it changes first, and a block is
+ * freed when no file has it. Returns 0, or -1 if error (no src, dst
+ * exists or the directory is full). */
+int  fs_clone(char *src, char *dst);
+
+/* bulk delete: return the number of files deleted (-1 if error); pattern
+ * has fnmatch(3) wildcards ("LOG*.TMP"), case is ignored as in file names */
+int  fs_delete_many(char **names, int n);
+int  fs_delete_pattern(char *pattern);
+
+/* open file handles */
+int  fs_open(char *name, int create);
+int  fs_pread(int fd, char *data, int length, int offset);
+int  fs_pwrite(int fd, char *data, int length, int offset);
+int  fs_close(int fd);
+
+/* asynchronous reads/writes: a request runs in a worker thread (data must
+ * stay valid until it completes) and requests on the same file complete in
+ * submission order. With a callback, it is called from the worker with the
+ * fs_read/fs_write result and the request is released; else the result is
+ * collected with fs_aio_wait/fs_aio_poll (1: done, 0: not yet, -1: bad id).
+ * At most 256 requests may be held at once, counting completed ones not
+ * yet collected: past that, submit waits while some request is running,
+ * else (or from a callback) it returns -1 with errno EAGAIN. */
+typedef void (*fs_aio_callback)(int id, int result, void *arg);
+
+int  fs_read_async(char *name, char *data, int length, int offset, fs_aio_callback cb, void *arg);
+int  fs_write_async(char *name, char *data, int length, int offset, fs_aio_callback cb, void *arg);
+int  fs_aio_wait(int id, int *result);
+int  fs_aio_poll(int id, int *result);
+
+/* runtime statistics */
+enum fs_op { // public calls
+    FS_OP_FORMAT, FS_OP_MOUNT, FS_OP_UNMOUNT, FS_OP_SYNC, FS_OP_DIR,
+    FS_OP_READ, FS_OP_WRITE, FS_OP_DELETE, FS_OP_FALLOCATE, FS_OP_TRUNCATE,
+    FS_OP_OPEN, FS_OP_PREAD, FS_OP_PWRITE, FS_OP_CLOSE, FS_OP_DEFRAG,
+    FS_OP_CLONE,
+    FS_OP_OTHER, // I/O outside public calls (e.g. the exit flush)
+    FS_NOPS
+};
+
+#define FS_HIST_BUCKETS 32 // latency bucket i: [2^i, 2^(i+1)) ns
+
+struct fs_stats {
+    unsigned long calls[FS_NOPS];       // number of calls
+    unsigned long blockReads[FS_NOPS];  // physical disk blocks read
+    unsigned long blockWrites[FS_NOPS]; // and written during the calls
+    unsigned long latency[FS_NOPS][FS_HIST_BUCKETS]; // log2 histogram
+    unsigned long lookups;      // directory lookups
+    unsigned long lookupProbes; // dirents compared by them (in memory)
+    unsigned long allocs;       // block allocations (single or runs)
+    unsigned long allocWords;   // bitmap words searched by them
+    int freeBlocks;             // free blocks now
+};
+
+void fs_stats(struct fs_stats *stats);
+void fs_stats_reset();
+
+/* call tracing: while on, every public call (deletes as one fs_delete per
+ * file, async requests as the fs_read/fs_write they run) is appended to a
+ * binary trace file as it ends: a header, then one record per call.
+ * replay.c runs a trace on a fresh disk image. */
+#define FS_TRACE_MAGIC 0x52545346 // "FSTR"
+
+struct fs_trace_hdr {
+    uint32_t magic;   // FS_TRACE_MAGIC
+    uint32_t recSize; // sizeof(struct fs_trace_rec)
+    uint32_t blocks;  // disk size of the traced volume
+    uint32_t unused;
+};
+
+struct fs_trace_rec {
+    uint64_t time;   // call start, ns since fs_trace_start
+    int32_t offset;  // of reads/writes
+    int32_t length;  // of reads/writes, size of fs_fallocate/fs_truncate, create of
+                     // fs_open, maxFiles of fs_defrag
+    int32_t fd;      // file handle of fs_pread/fs_pwrite/fs_close (else -1)
+    int32_t result;  // value returned (fs_dir: 0)
+    uint8_t op;      // enum fs_op
+    char name[11];   // file name (fs_format: label), no '\0' if 11 chars long
+    char name2[11];  // fs_clone: name of the clone (as name)
+    uint8_t unused;
+};
+
+int  fs_trace_start(const char *filename);
+int  fs_trace_stop();
+
+/* filesystem contexts: each one mounts its own disk, and many can be used
+ * at once (one thread per volume or more). The calls above and in fs.h
+ * use a default context on the disk.h device. */
+struct iovec;
+
+struct fs_disk { // a disk handle: read/write/size are required, others may be NULL
+    int  (*size)(struct fs_disk *d); // in blocks
+    void (*read)(struct fs_disk *d, int block, char *data);
+    void (*write)(struct fs_disk *d, int block, const char *data);
+    void (*readv)(struct fs_disk *d, int first, const struct iovec *iov, int nblocks);
+    void (*writev)(struct fs_disk *d, int first, const struct iovec *iov, int nblocks);
+    const char *(*borrow)(struct fs_disk *d, int block); // read-only block in memory
+    void (*msync)(struct fs_disk *d);                     // write the mapping to storage
+    void *dev;                                            // backend state
+};
+
+struct fs_ctx; // opaque
+
+struct fs_ctx *fs_ctx_new(struct fs_disk *disk);
+void fs_ctx_free(struct fs_ctx *fs);
+
+int  fs_ctx_format(struct fs_ctx *fs, char *disklabel);
+int  fs_ctx_mount(struct fs_ctx *fs);
+int  fs_ctx_unmount(struct fs_ctx *fs);
+int  fs_ctx_sync(struct fs_ctx *fs);
+void fs_ctx_dir(struct fs_ctx *fs);
+void fs_ctx_debug(struct fs_ctx *fs);
+int  fs_ctx_read(struct fs_ctx *fs, char *name, char *data, int length, int offset);
+int  fs_ctx_write(struct fs_ctx *fs, char *name, char *data, int length, int offset);
+int  fs_ctx_delete(struct fs_ctx *fs, char *name);
+int  fs_ctx_delete_many(struct fs_ctx *fs, char **names, int n);
+int  fs_ctx_delete_pattern(struct fs_ctx *fs, char *pattern);
+int  fs_ctx_clone(struct fs_ctx *fs, char *src, char *dst);
+int  fs_ctx_frag(struct fs_ctx *fs, struct fs_frag *frag);
+int  fs_ctx_defrag(struct fs_ctx *fs, int maxFiles, struct fs_frag *before, struct fs_frag *after);
+int  fs_ctx_fallocate(struct fs_ctx *fs, char *name, int size);
+int  fs_ctx_truncate(struct fs_ctx *fs, char *name, int size);
+int  fs_ctx_open(struct fs_ctx *fs, char *name, int create);
+int  fs_ctx_pread(struct fs_ctx *fs, int fd, char *data, int length, int offset);
+int  fs_ctx_pwrite(struct fs_ctx *fs, int fd, char *data, int length, int offset);
+int  fs_ctx_close(struct fs_ctx *fs, int fd);
+int  fs_ctx_cache_config(struct fs_ctx *fs, int nblocks, int writeThrough);
+int  fs_ctx_readahead_config(struct fs_ctx *fs, int maxBlocks);
+int  fs_ctx_compress_config(struct fs_ctx *fs, int on);
+int  fs_ctx_format_config(struct fs_ctx *fs, int blockSize);
+void fs_ctx_cache_stats(struct fs_ctx *fs, struct fs_cache_stats *stats);
+int  fs_ctx_read_async(struct fs_ctx *fs, char *name, char *data, int length, int offset,
+                       fs_aio_callback cb, void *arg);
+int  fs_ctx_write_async(struct fs_ctx *fs, char *name, char *data, int length, int offset,
+                        fs_aio_callback cb, void *arg);
+int  fs_ctx_aio_wait(struct fs_ctx *fs, int id, int *result);
+int  fs_ctx_aio_poll(struct fs_ctx *fs, int id, int *result);
+void fs_ctx_stats(struct fs_ctx *fs, struct fs_stats *stats);
+void fs_ctx_stats_reset(struct fs_ctx *fs);
+int  fs_ctx_trace_start(struct fs_ctx *fs, const char *filename);
+int  fs_ctx_trace_stop(struct fs_ctx *fs);
+
+#endif
@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_ext.h"
+#include "bench_util.h"
+
+/*******
+ * Trace replay: runs a call trace recorded with fs_trace_start on a fresh
+ * disk image, as fast as possible or (-T) at the original timing, and
+ * reports for each kind of call ops/sec, bytes/sec, latency percentiles
+ * and physical disk blocks read/written per call, and for all calls.
+ *
+ * usage: replay [-d image] [-n blocks] [-c cacheblocks] [-W] [-z] [-b blocksize]
+ *               [-T] [-f text|csv|json] trace
+ * Calls run one at a time in trace order (the order they ended in), on a
+ * disk of the traced size unless -n is given. If the trace does not start
+ * with fs_format the image is formatted and mounted first. Data written is
+ * a fixed pattern; results that differ from the traced ones are counted
+ * (the replay diverged from the traced run, e.g. another disk size).
+ * -z replays it with compressed extents, -b on the large format with
+ * blocksize byte blocks (see fs_format_config).
+ */
+
+const char *opNames[FS_NOPS] = {
+    [FS_OP_FORMAT] = "format", [FS_OP_MOUNT] = "mount", [FS_OP_UNMOUNT] = "unmount",
+    [FS_OP_SYNC] = "sync", [FS_OP_DIR] = "dir", [FS_OP_READ] = "read",
+    [FS_OP_WRITE] = "write", [FS_OP_DELETE] = "delete", [FS_OP_FALLOCATE] = "fallocate",
+    [FS_OP_TRUNCATE] = "truncate", [FS_OP_OPEN] = "open", [FS_OP_PREAD] = "pread",
+    [FS_OP_PWRITE] = "pwrite", [FS_OP_CLOSE] = "close", [FS_OP_DEFRAG] = "defrag",
+    [FS_OP_CLONE] = "clone", [FS_OP_OTHER] = "other",
+};
+
+#define MAXFDS 256 // traced file handles mapped to replayed ones
+
+char *image = "replay.img";
+int nblocks = 0;
+int cacheBlocks = 64;
+int writeThrough = 0;
+int compress = 0;
+int blockSize = 0;
+int timed = 0;
+const char *format = "text";
+char *buf;
+int bufSize;
+
+/**
+ * make buf (a fixed pattern) at least n bytes long
+ * return: 0 if ok, -1 if out of memory
+ */
+int bufGrow(int n) {
+    if (n <= bufSize)
+        return 0;
+    char *b = realloc(buf, n);
+    if (b == NULL)
+        return -1;
+    buf = b;
+    for (int i = bufSize; i < n; i++)
+        buf[i] = 'a' + i % 26;
+    bufSize = n;
+    return 0;
+}
+
+void add(struct result *r, long ns, int bytes) {
+    if (r->ops == r->maxOps) {
+        r->maxOps = r->maxOps ? 2 * r->maxOps : 1024;
+        r->lat = realloc(r->lat, r->maxOps * sizeof(long));
+    }
+    r->lat[r->ops++] = ns;
+    if (bytes > 0)
+        r->bytes += bytes;
+}
+
+/**
+ * run traced call rec (its fs_pread/fs_pwrite/fs_close handle mapped
+ * through fds)
+ * return: the call result
+ */
+int runCall(struct fs_trace_rec *rec, int *fds) {
+    char name[sizeof(rec->name) + 1], name2[sizeof(rec->name2) + 1];
+    int fd = rec->fd >= 0 && rec->fd < MAXFDS ? fds[rec->fd] : -1;
+    int r;
+
+    memcpy(name, rec->name, sizeof(rec->name));
+    name[sizeof(rec->name)] = '\0';
+    memcpy(name2, rec->name2, sizeof(rec->name2));
+    name2[sizeof(rec->name2)] = '\0';
+    switch (rec->op) {
+    case FS_OP_FORMAT: return fs_format(name);
+    case FS_OP_MOUNT: return fs_mount();
+    case FS_OP_UNMOUNT: return fs_unmount();
+    case FS_OP_SYNC: return fs_sync();
+    case FS_OP_DIR: fs_dir(); return 0;
+    case FS_OP_READ: return fs_read(name, buf, rec->length, rec->offset);
+    case FS_OP_WRITE: return fs_write(name, buf, rec->length, rec->offset);
+    case FS_OP_DELETE: return fs_delete(name);
+    case FS_OP_FALLOCATE: return fs_fallocate(name, rec->length);
+    case FS_OP_TRUNCATE: return fs_truncate(name, rec->length);
+    case FS_OP_OPEN:
+        r = fs_open(name, rec->length);
+        if (rec->result >= 0 && rec->result < MAXFDS)
+            fds[rec->result] = r;
+        return r;
+    case FS_OP_PREAD: return fs_pread(fd, buf, rec->length, rec->offset);
+    case FS_OP_PWRITE: return fs_pwrite(fd, buf, rec->length, rec->offset);
+    case FS_OP_CLOSE:
+        r = fs_close(fd);
+        if (rec->fd >= 0 && rec->fd < MAXFDS)
+            fds[rec->fd] = -1;
+        return r;
+    case FS_OP_DEFRAG: return fs_defrag(rec->length, NULL, NULL);
+    case FS_OP_CLONE: return fs_clone(name, name2);
+    }
+    return rec->result; // unknown op: skipped
+}
+
+int main(int argc, char *argv[]) {
+    struct result res[FS_NOPS], all;
+    struct fs_trace_hdr hdr;
+    struct fs_trace_rec rec;
+    struct fs_stats st0, st1, st2;
+    int fds[MAXFDS];
+    long mismatches = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:n:c:Wzb:Tf:")) != -1)
+        switch (opt) {
+        case 'd': image = optarg; break;
+        case 'n': nblocks = atoi(optarg); break;
+        case 'c': cacheBlocks = atoi(optarg); break;
+        case 'W': writeThrough = 1; break;
+        case 'z': compress = 1; break;
+        case 'b': blockSize = atoi(optarg); break;
+        case 'T': timed = 1; break;
+        case 'f': format = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-d image] [-n blocks] [-c cacheblocks] [-W] [-z]"
+                            " [-b blocksize] [-T] [-f text|csv|json] trace\n", argv[0]);
+            return 1;
+        }
+    FILE *trace = optind < argc ? fopen(argv[optind], "rb") : NULL;
+    if (trace == NULL) {
+        fprintf(stderr, "cannot open trace %s\n", optind < argc ? argv[optind] : "(none)");
+        return 1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, trace) != 1 || hdr.magic != FS_TRACE_MAGIC ||
+        hdr.recSize != sizeof(struct fs_trace_rec)) {
+        fprintf(stderr, "%s is not a trace (or of another version)\n", argv[optind]);
+        return 1;
+    }
+    if (nblocks == 0)
+        nblocks = (int) hdr.blocks;
+    if (fs_format_config(blockSize) == -1)
+        return 1;
+    unlink(image); // (scratch image: a new one of nblocks)
+    if (nblocks < 64 || !disk_init(image, nblocks)) {
+        fprintf(stderr, "cannot create disk image %s with %d blocks\n", image, nblocks);
+        return 1;
+    }
+
+    memset(res, 0, sizeof(res));
+    memset(&all, 0, sizeof(all));
+    for (int i = 0; i < MAXFDS; i++)
+        fds[i] = -1;
+    int n = fread(&rec, sizeof(rec), 1, trace);
+    quiet(1);
+    fs_cache_config(cacheBlocks, writeThrough);
+    fs_compress_config(compress);
+    if (n == 1 && rec.op != FS_OP_FORMAT) { // traced on a mounted disk
+        fs_format("replay");
+        fs_mount();
+    }
+    fs_sync();
+    fs_stats(&st0);
+    long long start = clockNs();
+    for (; n == 1; n = fread(&rec, sizeof(rec), 1, trace)) {
+        if (rec.op >= FS_NOPS || bufGrow(rec.length) == -1)
+            continue;
+        if (timed) { // wait for the call's time in the trace
+            long long wait = (long long) rec.time - (clockNs() - start);
+            if (wait > 0) {
+                struct timespec ts = {wait / 1000000000LL, wait % 1000000000LL};
+                nanosleep(&ts, NULL);
+            }
+        }
+        long long t0 = clockNs();
+        int r = runCall(&rec, fds);
+        long ns = clockNs() - t0;
+        int rw = rec.op == FS_OP_READ || rec.op == FS_OP_WRITE ||
+                 rec.op == FS_OP_PREAD || rec.op == FS_OP_PWRITE;
+        add(&res[rec.op], ns, rw ? r : 0);
+        add(&all, ns, rw ? r : 0);
+        mismatches += r != rec.result;
+    }
+    fs_stats(&st1);
+    fs_sync(); // count the deferred writes too (in all)
+    double secs = (clockNs() - start) / 1e9;
+    fs_stats(&st2);
+    quiet(0);
+    if (secs <= 0)
+        secs = 1e-9;
+    fclose(trace);
+
+    int first = 1;
+    for (int op = 0; op < FS_NOPS; op++) {
+        if (res[op].ops == 0)
+            continue;
+        res[op].name = opNames[op];
+        res[op].secs = secs;
+        res[op].reads = st1.blockReads[op] - st0.blockReads[op];
+        res[op].writes = st1.blockWrites[op] - st0.blockWrites[op];
+        report(&res[op], "op", format, first, 0);
+        first = 0;
+        free(res[op].lat);
+    }
+    all.name = "all";
+    all.secs = secs;
+    for (int op = 0; op < FS_NOPS; op++) {
+        all.reads += st2.blockReads[op] - st0.blockReads[op];
+        all.writes += st2.blockWrites[op] - st0.blockWrites[op];
+    }
+    report(&all, "op", format, first, 1);
+    free(all.lat);
+    if (mismatches > 0)
+        fprintf(stderr, "%ld calls returned other results than in the trace\n", mismatches);
+
+    quiet(1);
+    fs_unmount();
+    quiet(0);
+    disk_close();
+    return 0;
+}